@@ -6,28 +6,43 @@
 //  Copyright (c) 2013 cooniur. All rights reserved.
 //
 
+// accept4()
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <assert.h>
 #include <string.h>
 #include <execinfo.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
 
 #include "lwt.h"
-#include "ring_queue.h"
-#include "dlinkedlist.h"
+#include "mpmc_queue.h"
+#include "mpsc_queue.h"
+#include "ws_deque.h"
+#include "ptr_set.h"
+#include "timer_wheel.h"
+#include "uring.h"
 #include "debug_print.h"
 
 #define LWT_KTHD_LOCAL	__thread
 #define LWT_KTHD_GLOBAL
 
-/**
- Gets the offset of a field inside a struc
- */
-#define LWT_STRUCT_OFFSET(Field) \
-[Field] "i" (offsetof(struct __lwt_t__, Field))
-
 /**
  Default size of the stack used by a lwt thread
  */
@@ -38,9 +53,43 @@
  */
 #define TCB_POOL_SIZE (64)
 
-#define __ATTR_ALWAYS_INLINE__ __attribute__((always_inline))
+/**
+ Stack size classes: class i holds stacks of LWT_STACK_CLASS_MIN << (2 * i) bytes,
+ i.e. 4 KB, 16 KB, 64 KB, 256 KB, 1 MB, 4 MB and 16 MB
+ */
+#define LWT_STACK_CLASS_MIN		(1024 * 4)
+#define LWT_STACK_CLASS_NUM		(7)
+#define LWT_STACK_CLASS_SIZE(i)	((size_t)LWT_STACK_CLASS_MIN << (2 * (i)))
+
+/**
+ Number of bytes of stack in each slab, so that a slab holds
+ TCB_POOL_SIZE default-sized TCBs
+ */
+#define TCB_POOL_BYTES	(TCB_POOL_SIZE * DEFAULT_LWT_STACK_SIZE)
+
+/**
+ Default number of bytes of free slab memory a kernel thread keeps
+ before it returns entirely free slabs to the OS
+ */
+#define LWT_SLAB_DEFAULT_HWM	(1024 * 1024 * 8)
+
+/**
+ Bytes taken by a TCB in the TCB arena
+ */
+#define LWT_TCB_BYTES	((sizeof(struct __lwt_t__) + 63) & ~(size_t)63)
 
-typedef struct __lwt_kthd_t__ lwt_kthd_t;
+/**
+ Bytes of each chunk of the TCB arena
+ */
+#define LWT_TCB_ARENA_BYTES	(1024 * 64)
+
+/**
+ Initial MXCSR and x87 control word of a new thread (power-on defaults)
+ */
+#define LWT_INIT_MXCSR	(0x1F80ULL)
+#define LWT_INIT_FPU_CW	(0x037FULL)
+
+#define __ATTR_ALWAYS_INLINE__ __attribute__((always_inline))
 
 /**
  Thread Descriptor
@@ -48,59 +97,58 @@ typedef struct __lwt_kthd_t__ lwt_kthd_t;
 struct __lwt_t__
 {
 	/**
-	 Stack Base Pointer
-	 Offset: 0x0
-	 */
-	void* ebp;
-	
-	/**
-	 Stack Pointer
-	 Offset: 0x4
+	 Saved Stack Pointer (%esp on i386, %rsp on x86-64)
+	 Offset: 0x0 (used by __lwt_ctx_switch)
 	 */
-	void* esp;
+	void* sp;
 	
 	/**
 	 Thread Entry Function Pointer
-	 Offset: 0x8
 	 */
 	lwt_fn_t entry_fn;
 	
 	/**
 	 Thread Entry Function Parameter Pointer
-	 Offset: 0xc
 	 */
 	void* entry_fn_param;
 	
 	/**
 	 Thread Return Value Pointer
-	 Offset: 0x10
 	 */
 	void* return_val;
 	
 	/**
 	 Thread status
-	 Offset: 0x14
 	 */
 	lwt_status_t status;
 	
 	/**
-	 Stack Memory Pointer by malloc
-	 Offset: 0x18
+	 Lowest address of the stack, carved from a slab right above its guard
+	 page; NULL for a main thread, or once the slab is unmapped
 	 */
 	void* stack;
 	
 	/**
 	 Thread ID
-	 Offset: 0x1c
 	 */
 	int id;
 	
 	/**
 	 Stack Size
-	 Offset: 0x20
 	 */
 	size_t stack_size;
 	
+	/**
+	 Stack size class, index of the dead queue this TCB is recycled to
+	 */
+	int stack_class;
+	
+	/**
+	 Slab holding the stack of this TCB, NULL for a main thread, or once
+	 the slab is unmapped
+	 */
+	struct __lwt_slab_t__* slab;
+	
 	/**
 	 In which queue this lwt is
 	 */
@@ -108,13 +156,11 @@ struct __lwt_t__
 	
 	/**
 	 Points to the next thread descriptor
-	 Offset: 0x24
 	 */
 	struct __lwt_t__* next;
 	
 	/**
 	 Points to the previous thread descriptor
-	 Offset: 0x28
 	 */
 	struct __lwt_t__* prev;
 	
@@ -133,7 +179,41 @@ struct __lwt_t__
 	 */
 	lwt_kthd_t* kthd;
 	
-} __attribute__ ((aligned (16), packed));
+	/**
+	 Link in the message queue of a kernel thread (see __lwt_kthd_wakeup)
+	 */
+	mpsc_node_t inbox_node;
+	
+	/**
+	 Set while inbox_node is in a message queue, so it is queued only once.
+	 Survives TCB recycling, as a stale wakeup may still be in flight.
+	 */
+	int inbox_queued;
+	
+	/**
+	 Set while the lwt, not started yet, waits in the work-stealing deque
+	 of a pool worker (see lwt_kthd_pool), where any worker may take it
+	 */
+	int stealable;
+	
+	/**
+	 Serial of the last channel this lwt was added to as a sender,
+	 so that sending on it again skips the sender registry
+	 */
+	unsigned long snd_serial;
+	
+	/**
+	 Timer of a timed block in the timer wheel of the kernel thread,
+	 see __lwt_block_until(). Pending while armed
+	 */
+	timer_wheel_node_t timer;
+	
+	/**
+	 Thread name
+	 */
+	char name[LWT_NAME_LEN];
+	
+} __attribute__ ((aligned (16)));
 
 /**
  Thread queue type
@@ -145,38 +225,78 @@ struct __lwt_queue_t__
 	char name[8];
 };
 
+/**
+ Entry of a wait list, embedded in the stack frame of the blocked lwt,
+ which must not return before it is unlinked
+ */
+struct __lwt_waiter_t__
+{
+	lwt_t lwt;
+	struct __lwt_waiter_t__* prev;
+	struct __lwt_waiter_t__* next;
+	
+	/**
+	 Set while linked into a wait list
+	 */
+	int queued;
+	
+	/**
+	 Message slot of an unbuffered channel operation: points to the value
+	 a parked sender offers, or to where a parked receiver wants it
+	 */
+	void* data;
+};
+
+/**
+ Intrusive FIFO of blocked lwts, linking and unlinking never allocates
+ */
+struct __lwt_wait_list_t__
+{
+	struct __lwt_waiter_t__* head;
+	struct __lwt_waiter_t__* tail;
+};
+
 struct __lwt_cgrp_t__
 {
 	/**
-	 Channels that have a specific event occurred in the group
-		0: snd event queue
-		1: rcv event queue
+	 Channels that have a specific event occurred in the group, linked
+	 through lwt_chan_t.ready_next, oldest first
+		0: snd event ready list
+		1: rcv event ready list
 	 */
-	dlinkedlist_t* event_queue[2];
+	struct __lwt_chan_t__* ready_head[2];
+	struct __lwt_chan_t__* ready_tail[2];
 
 	/**
-	 lwts that are waiting for events to occur
-		0: lwts waiting for snd event to happen
-		1: lwts waiting for rcv event to happen
+	 The lwt blocked in lwt_cgrp_wait() until a channel becomes ready
+		0: lwt waiting for snd event to happen
+		1: lwt waiting for rcv event to happen
 	 */
-	dlinkedlist_t* wait_queue[2];
+	lwt_t waiter[2];
 	
 	/**
-	 Stores lwts that listen to event on the specific direction
-		0: lwts listening to snd event to happen
-		1: lwts listening to rcv event to happen
+	 The lwt that listens to event on the specific direction, the only
+	 one allowed to wait for it
+		0: lwt listening to snd event to happen
+		1: lwt listening to rcv event to happen
 	 */
-	dlinkedlist_t* listeners[2];
+	lwt_t listener[2];
 	
 	/**
-	 Number of channels in this group
+	 Number of channels in this group, per direction
 	 */
-	size_t channel_num;
+	size_t channel_num[2];
 	
 	/**
 	 Total number of events that happened on this group
 	 */
 	size_t total_num_events;
+	
+	/**
+	 Spin lock protecting the ready lists and the waiters, taken after
+	 the lock of a channel when both are needed
+	 */
+	int lock;
 };
 
 struct __lwt_chan_t__
@@ -187,19 +307,22 @@ struct __lwt_chan_t__
 	char *name;
 	
 	/**
-	 Sender's data
+	 Sender queue
 	 */
-	void *snd_data;
+	struct __lwt_wait_list_t__ s_queue;
 	
 	/**
-	 Sender queue
+	 Receivers parked on the channel
 	 */
-	dlinkedlist_t* s_queue;
+	struct __lwt_wait_list_t__ r_queue;
 	
 	/**
-	 Indicates whether a receiver is blocked on this channel
+	 Number of lwts in s_queue and r_queue of a buffered channel.
+	 Read without the lock, so that the lock-free paths only take it
+	 when there is someone to wake up (see __lwt_chan_park)
 	 */
-	int rcv_blocked;
+	int s_parked;
+	int r_parked;
 	
 	/**
 	 The receiver thread
@@ -207,19 +330,29 @@ struct __lwt_chan_t__
 	lwt_t receiver;
 	
 	/**
-	 Sender's data buffer
+	 Sender's data buffer, shared lock-free by all senders and receivers
 	 */
-	ring_queue_t* snd_buffer;
+	mpmc_queue_t* snd_buffer;
 	
 	/**
 	 Sender's data buffer size;
 	 */
 	size_t snd_buffer_size;
 	
+	/**
+	 Size of a message, copied by value; sizeof(void*) for lwt_chan()
+	 */
+	size_t elem_size;
+	
 	/**
 	 Sender list
 	 */
-	dlinkedlist_t* s_list;
+	ptr_set_t* s_list;
+	
+	/**
+	 Unique number of this channel, never reused (see lwt_t.snd_serial)
+	 */
+	unsigned long serial;
 	
 	/**
 	 Tag for the channel
@@ -241,22 +374,358 @@ struct __lwt_chan_t__
 	size_t events_num[2];
 	
 	/**
-	 Indicates whether this channel is queued in event queue.
+	 Next channel in the ready list of grp[0] and grp[1]
+	 */
+	struct __lwt_chan_t__* ready_next[2];
+	
+	/**
+	 Spin lock protecting the channel, as its endpoints may live
+	 on different kernel threads
+	 */
+	int lock;
+	
+	/**
+	 Indicates whether this channel is queued in the group's ready list.
 	 This flag makes sure that when doing a grouped buffered sending,
-	 the channel only be added into the group's event queue only once.
+	 the channel only be added into the ready list only once.
 	 0: snd event queued
 	 1: rcv event queued
 	 */
 	int event_queued[2];
 };
 
+/**
+ Marks a joinable thread that died before anyone joined it
+ Stored in lwt->joiner, so that lwt_die() and lwt_join() agree on
+ who comes first even when they run on different kernel threads
+ */
+#define LWT_JOINER_ZOMBIE ((lwt_t)1)
+
+/**
+ Number of spins of a spin lock before it gives up the CPU
+ */
+#define LWT_KTHD_IDLE_SPIN (64)
+
+/**
+ Number of empty rounds of the idle thread before it parks the kernel thread
+ */
+#define LWT_KTHD_PARK_SPIN (256)
+
+/**
+ Number of switches in a row to the run-next thread, after which a
+ wakeup goes to the tail of the run queue again, so that a ping-pong
+ pair cannot starve the other threads
+ */
+#define LWT_RUNNEXT_MAX (16)
+
+/**
+ Initial capacity of the work-stealing deque of a pool worker
+ */
+#define LWT_POOL_DEQUE_SIZE (256)
+
+/**
+ Maximum number of lwts a pool worker moves from its deque into its
+ run queue each time its idle thread runs
+ */
+#define LWT_POOL_BATCH (16)
+
+/**
+ A tick of the timer wheels is 1 << LWT_TIMER_TICK_SHIFT ns (16.4 us).
+ Timers fire at the first tick boundary after their deadline
+ */
+#define LWT_TIMER_TICK_SHIFT (14)
+
+/**
+ Deadlines of blocking operations: already passed (try) and never
+ */
+#define LWT_DEADLINE_NOW	((lwt_time_t)0)
+#define LWT_DEADLINE_NEVER	(~(lwt_time_t)0)
+
+/**
+ Values of lwt_kthd_t.parked
+ */
+#define LWT_KTHD_PARKED_FUTEX	(1)
+#define LWT_KTHD_PARKED_POLL	(2)
+
+/**
+ Maximum number of fd events handled by one epoll_wait()
+ */
+#define LWT_POLL_BATCH (64)
+
+/**
+ Events a fd is registered for in the netpoller
+ */
+#define LWT_POLL_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/**
+ Number of submission slots of the io_uring of a kernel thread
+ */
+#define LWT_URING_ENTRIES (256)
+
+/**
+ Maximum number of helper threads, started as jobs find all the others
+ busy, and number of the jobs that can be queued for them
+ */
+#define LWT_HELPER_MAX (16)
+#define LWT_HELPER_QUEUE (1024)
+
+/**
+ Number of thread ids a kernel thread takes from __lwt_threadid at a time
+ */
+#define LWT_ID_BLOCK (1024)
+
 /**
  kernal thread Struct
  */
 struct __lwt_kthd_t__
 {
 	pthread_t pthread_id;
-	void* message_queue;
+	
+	/**
+	 lwts woken up (or created) by other kernel threads, waiting to be
+	 moved into this kernel thread's run queue by __lwt_kthd_drain()
+	 Lock-free: pushed by any kernel thread, popped by the owner only
+	 */
+	mpsc_queue_t* message_queue;
+	
+	/**
+	 Number of lwts that died on this kernel thread and are not joined yet.
+	 Updated atomically, as the joiner may be on another kernel thread
+	 */
+	long zombie_num;
+	
+	/**
+	 Number of blocked lwts. They are on no queue of the kernel thread:
+	 whatever they wait for (a channel, a joined thread, a group, a timer,
+	 a fd) knows them and wakes them up
+	 */
+	size_t blocked_num;
+	
+	/**
+	 Set while the kernel thread sleeps in __lwt_kthd_park(): to
+	 LWT_KTHD_PARKED_FUTEX, when it is the futex word slept on, or to
+	 LWT_KTHD_PARKED_POLL, when the kernel thread sleeps in epoll_wait().
+	 Cleared by the first __lwt_kthd_unpark() that sees it set
+	 */
+	int parked;
+	
+	/**
+	 Times the kernel thread went to sleep in __lwt_kthd_park()
+	 */
+	size_t park_num;
+	
+	/**
+	 New lwts created on this kernel thread, NULL unless it is a pool worker.
+	 Pushed and popped by the owner, stolen by the other workers
+	 */
+	ws_deque_t* run_deque;
+	
+	/**
+	 Index of the first worker to steal from next time
+	 */
+	size_t steal_next;
+	
+	/**
+	 Block of thread ids owned by this kernel thread: [id_next, id_end)
+	 */
+	int id_next;
+	int id_end;
+	
+	/**
+	 Dead TCBs of our slabs freed by other kernel threads, linked by next.
+	 Pushed by any kernel thread, taken all at once by the owner
+	 */
+	lwt_t remote_free;
+	
+	/**
+	 Slab being carved into new TCBs, one per stack size class
+	 */
+	struct __lwt_slab_t__* carving[LWT_STACK_CLASS_NUM];
+	
+	/**
+	 TCBs are never unmapped, so that a stale lwt_t still reads as a dead
+	 thread: tcb_free links, by next, the TCBs of unmapped slabs, and
+	 [tcb_arena, tcb_arena_end) is what is left of the current arena chunk
+	 */
+	lwt_t tcb_free;
+	char* tcb_arena;
+	char* tcb_arena_end;
+	
+	/**
+	 Bytes mapped by our slabs, and bytes of them in free slots
+	 */
+	size_t slab_bytes;
+	size_t free_bytes;
+	
+	/**
+	 Timers of the lwts blocked with a deadline, advanced at every
+	 scheduling point. Only touched by the owner
+	 */
+	timer_wheel_t* timers;
+	
+	/**
+	 Number of armed timers, so that scheduling points skip the wheel
+	 while there is none
+	 */
+	size_t timer_num;
+	
+	/**
+	 Netpoller: epoll instance, -1 until a lwt first waits on a fd, and
+	 an eventfd in it, written to unpark the kernel thread from epoll_wait()
+	 */
+	int epfd;
+	int evfd;
+	
+	/**
+	 Poll state of the fds registered with epfd, indexed by fd
+	 */
+	struct __lwt_pollfd_t__* pollfds;
+	size_t pollfd_cap;
+	
+	/**
+	 Number of lwts blocked on a fd, the idle thread only polls while
+	 there is one
+	 */
+	size_t poll_num;
+	
+	/**
+	 io_uring of lwt_pread() and friends, NULL until first used, or if
+	 io_uring is not available (uring_tried is then set); completions
+	 signal evfd, so that the kernel thread parks in the netpoller
+	 while io_num operations are in flight
+	 */
+	uring_t* uring;
+	int uring_tried;
+	size_t io_num;
+	
+	/**
+	 Set by lwt_offload() until the idle thread has set up the helpers
+	 */
+	int helpers_wanted;
+};
+
+/**
+ A file operation of lwt_pread() and friends, on the stack of the
+ lwt that waits for it
+ */
+struct __lwt_io_t__
+{
+	int op;
+	int fd;
+	void* buf;
+	size_t count;
+	off_t offset;
+	
+	lwt_t lwt;
+	ssize_t res;
+	int done;
+};
+
+/**
+ A call run by a helper thread (see lwt_offload), on the stack of the
+ lwt that waits for it
+ */
+struct __lwt_helper_job_t__
+{
+	void* (*fn)(void*);
+	void* arg;
+	void* ret;
+	
+	lwt_t lwt;
+	int done;
+};
+
+/**
+ Helper pthreads running the calls that would block a kernel thread
+ */
+struct __lwt_helpers_t__
+{
+	/**
+	 Queued jobs, by pointer
+	 */
+	mpmc_queue_t* jobs;
+	
+	/**
+	 Futex word, bumped by every push; idle helpers wait for it to change
+	 */
+	int seq;
+	int idle_num;
+	
+	/**
+	 Number of helpers started, up to LWT_HELPER_MAX
+	 */
+	int helper_num;
+};
+
+/**
+ Poll state of a fd in the netpoller of a kernel thread. Registered
+ edge-triggered, so readiness that comes while nobody waits is kept
+ in rready/wready until the next wait
+ */
+struct __lwt_pollfd_t__
+{
+	// 1 if in epfd, -1 if epoll does not support fd (regular files,
+	// which never block), 0 if not seen yet
+	int registered;
+	lwt_t reader;
+	lwt_t writer;
+	int rready;
+	int wready;
+};
+
+/**
+ Contiguous chunk of stack slots of one size class, owned by the
+ kernel thread that mapped it
+ */
+struct __lwt_slab_t__
+{
+	char* base;
+	size_t size;
+	size_t slot_size;
+	int cls;
+	
+	size_t nslots;
+	/**
+	 Number of slots not carved yet or in the dead queue
+	 */
+	size_t nfree;
+	/**
+	 Number of slots carved into TCBs, from the lowest address up
+	 */
+	size_t carved;
+	
+	struct __lwt_kthd_t__* owner;
+	
+	/**
+	 TCB of each carved slot, which outlives the slab
+	 */
+	lwt_t tcbs[];
+};
+
+/**
+ Pool of kernel threads sharing their new lwts (see lwt_kthd_pool)
+ */
+struct __lwt_pool_t__
+{
+	/**
+	 Number of parked workers, so that creating a lwt only wakes one up
+	 when there is one
+	 */
+	int parked_num;
+	
+	/**
+	 Workers wait on it before running: 0 while lwt_kthd_pool() is still
+	 starting them, then 1, or -1 if it failed and they must exit
+	 */
+	int state;
+	
+	/**
+	 Started workers that have not exited yet after a failure
+	 */
+	int started_num;
+	
+	size_t size;
+	struct __lwt_kthd_t__* workers[];
 };
 
 struct __lwt_kthd_entry_param_t__
@@ -277,21 +746,29 @@ LWT_KTHD_LOCAL struct __lwt_kthd_t__* __current_kthd = NULL;
 LWT_KTHD_LOCAL struct __lwt_queue_t__ __run_q = {NULL, 0, "r"};
 
 /**
- The Wait Queue
- threads that are blocked will be added into this queue
+ The thread woken up last, queued right behind the current thread so
+ that it runs next, while its peer's data is still in the cache.
+ NULL once it ran
+ */
+LWT_KTHD_LOCAL lwt_t __runnext = NULL;
+
+/**
+ Number of switches in a row to __runnext, up to LWT_RUNNEXT_MAX
  */
-LWT_KTHD_LOCAL struct __lwt_queue_t__ __wait_q = {NULL, 0, "w"};
+LWT_KTHD_LOCAL int __runnext_streak = 0;
 
 /**
- The zombie queue
- threads that have died but not joined will be added to this queue
+ The thread that just called lwt_die() and is waiting to be finalized
+ by the next thread running on this kernel thread
  */
-LWT_KTHD_LOCAL struct __lwt_queue_t__ __zombie_q = {NULL, 0, "z"};
+LWT_KTHD_LOCAL lwt_t __dying_lwt = NULL;
 
 /**
- The Dead Queue: recycled TCBs
+ The Dead Queues: recycled TCBs, one per stack size class
  */
-LWT_KTHD_LOCAL struct __lwt_queue_t__ __dead_q = {NULL, 0, "d"};
+LWT_KTHD_LOCAL struct __lwt_queue_t__ __dead_q[LWT_STACK_CLASS_NUM] = {
+	[0 ... LWT_STACK_CLASS_NUM - 1] = {NULL, 0, "d"}
+};
 
 /**
  The main thread TCB
@@ -304,14 +781,43 @@ LWT_KTHD_LOCAL lwt_t __main_thread = NULL;
 LWT_KTHD_LOCAL lwt_t __idle_thread = NULL;
 
 /**
- Stores the next available thread id #
+ System page size, also the size of the guard page below each stack
+ */
+LWT_KTHD_GLOBAL size_t __lwt_page_size = 4096;
+
+/**
+ Stores the first thread id # of the next block handed to a kernel thread
  */
 LWT_KTHD_GLOBAL int __lwt_threadid = 1;
 
-// =======================================================
+/**
+ The pool of worker kernel threads, NULL until lwt_kthd_pool() is called
+ */
+LWT_KTHD_GLOBAL struct __lwt_pool_t__* __lwt_pool = NULL;
 
-static struct __lwt_queue_t__*		lwt_queue_init();
-static inline size_t				lwt_queue_size(struct __lwt_queue_t__* queue);
+/**
+ The helper threads, started on first use
+ */
+LWT_KTHD_GLOBAL struct __lwt_helpers_t__* __lwt_helpers = NULL;
+LWT_KTHD_GLOBAL pthread_once_t __lwt_helpers_once = PTHREAD_ONCE_INIT;
+/**
+ Set once __lwt_helpers_init() has run, whether it succeeded or not
+ */
+LWT_KTHD_GLOBAL int __lwt_helpers_tried = 0;
+
+/**
+ Free slab memory a kernel thread keeps, see lwt_slab_hwm_set()
+ */
+LWT_KTHD_GLOBAL size_t __lwt_slab_hwm = LWT_SLAB_DEFAULT_HWM;
+
+/**
+ Serial number of the last channel created
+ */
+LWT_KTHD_GLOBAL unsigned long __lwt_chan_serial = 0;
+
+// =======================================================
+
+static inline size_t				lwt_queue_size(struct __lwt_queue_t__* queue);
 static inline int					lwt_queue_empty(struct __lwt_queue_t__* queue);
 static inline void					lwt_queue_insert_before(struct __lwt_queue_t__* queue, struct __lwt_t__* victim, struct __lwt_t__* lwt);
 static inline void					lwt_queue_inqueue(struct __lwt_queue_t__* queue, struct __lwt_t__* lwt);
@@ -321,6 +827,12 @@ static inline void					lwt_queue_remove(struct __lwt_queue_t__* queue, struct __
 static inline struct __lwt_t__*		lwt_queue_peek(struct __lwt_queue_t__* queue);
 static inline struct __lwt_t__*		lwt_queue_peek_tail(struct __lwt_queue_t__* queue);
 
+static inline void		__lwt_wait_list_init(struct __lwt_wait_list_t__* list);
+static inline int		__lwt_wait_list_empty(struct __lwt_wait_list_t__* list);
+static inline void		__lwt_wait_list_add(struct __lwt_wait_list_t__* list, struct __lwt_waiter_t__* w);
+static inline void		__lwt_wait_list_remove(struct __lwt_wait_list_t__* list, struct __lwt_waiter_t__* w);
+static inline lwt_t		__lwt_wait_list_pop(struct __lwt_wait_list_t__* list);
+
 void __lwt_stack_trace()
 {
 	void *array[10];
@@ -376,24 +888,9 @@ void lwt_show_queue(int q)
 		case 1:
 			debug_showqueue(&__run_q);
 			break;
-
-		case 2:
-			debug_showqueue(&__wait_q);
-			break;
-
-		case 3:
-			debug_showqueue(&__zombie_q);
 	}
 }
 
-struct __lwt_queue_t__* lwt_queue_init()
-{
-	struct __lwt_queue_t__* queue = malloc(sizeof(struct __lwt_queue_t__));
-	queue->head = NULL;
-	queue->size = 0;
-	return queue;
-}
-
 size_t lwt_queue_size(struct __lwt_queue_t__* queue)
 {
 	return queue->size;
@@ -421,6 +918,7 @@ void lwt_queue_insert_before(struct __lwt_queue_t__* queue, struct __lwt_t__* vi
 
 		victim->prev = lwt;
 		lwt->next = victim;
+		lwt->queue = queue;
 		queue->size++;
 	}
 }
@@ -523,39 +1021,135 @@ struct __lwt_t__* lwt_queue_peek_tail(struct __lwt_queue_t__* queue)
 	return queue->head->prev;
 }
 
+void __lwt_wait_list_init(struct __lwt_wait_list_t__* list)
+{
+	list->head = list->tail = NULL;
+}
+
+int __lwt_wait_list_empty(struct __lwt_wait_list_t__* list)
+{
+	return list->head == NULL;
+}
+
+void __lwt_wait_list_add(struct __lwt_wait_list_t__* list, struct __lwt_waiter_t__* w)
+{
+	w->next = NULL;
+	w->prev = list->tail;
+	if (list->tail)
+		list->tail->next = w;
+	else
+		list->head = w;
+	list->tail = w;
+	w->queued = 1;
+}
+
+void __lwt_wait_list_remove(struct __lwt_wait_list_t__* list, struct __lwt_waiter_t__* w)
+{
+	if (w->prev)
+		w->prev->next = w->next;
+	else
+		list->head = w->next;
+
+	if (w->next)
+		w->next->prev = w->prev;
+	else
+		list->tail = w->prev;
+
+	// last access to w: its lwt may return as soon as it sees this
+	__atomic_store_n(&w->queued, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ Unlinks the first waiter, returns its lwt or NULL if the list is empty
+ */
+lwt_t __lwt_wait_list_pop(struct __lwt_wait_list_t__* list)
+{
+	struct __lwt_waiter_t__* w = list->head;
+	if (!w)
+		return NULL;
+
+	lwt_t lwt = w->lwt;
+	__lwt_wait_list_remove(list, w);
+	return lwt;
+}
+
 // =======================================================
 /**
  A new thread's entry point
  Calls __lwt_start (in assembly)
  */
-void __lwt_start(lwt_fn_t fn, void* data, lwt_chan_t c);
-static __attribute__ ((noinline)) void __lwt_dispatch(lwt_t next, lwt_t current);
+void* __lwt_start(lwt_fn_t fn, void* data, lwt_chan_t c);
+static inline void __lwt_dispatch(lwt_t next, lwt_t current);
 
 static inline lwt_t __lwt_current_inline();
 
 static void __lwt_block();
-static void __lwt_block_and_wakeup(lwt_t lwt);
+static int __lwt_block_until(lwt_time_t deadline);
 static void __lwt_wakeup(lwt_t blocked_lwt);
-static void __lwt_wakeup_all();
-
+static inline void __lwt_ready(lwt_t lwt);
+static inline void __lwt_ready_next(lwt_t lwt);
+
+static inline lwt_time_t __lwt_now();
+static inline lwt_time_t __lwt_deadline(lwt_time_t timeout);
+static void __lwt_timer_add(lwt_t lwt, lwt_time_t deadline);
+static void __lwt_timer_remove(lwt_t lwt);
+static void __lwt_timer_expire();
+
+static struct __lwt_pollfd_t__* __lwt_pollfd(int fd);
+static int __lwt_poll_wait(int fd, int write);
+static void __lwt_netpoll(const struct timespec* timeout);
+static int __lwt_netpoll_init();
+
+static void __lwt_helpers_init();
+static int __lwt_helper_start(struct __lwt_helpers_t__* helpers);
+static void* __lwt_helper_entry(void* param);
+
+static ssize_t __lwt_io(struct __lwt_io_t__* io);
+static void* __lwt_io_sync(void* param);
+static void __lwt_io_reap();
+
+static int __lwt_kthd_init(struct __lwt_kthd_t__* kthd);
+static void __lwt_kthd_fini(struct __lwt_kthd_t__* kthd);
 static void __lwt_kthd_wakeup(struct __lwt_kthd_t__* kthd, lwt_t blocked_lwt);
-
-static lwt_t	__lwt_init_lwt();
-static void		__lwt_init_tcb_pool();
+static int __lwt_kthd_unpark(struct __lwt_kthd_t__* kthd);
+static inline void __lwt_kthd_drain();
+static void __lwt_kthd_drain_batch();
+
+static inline int __lwt_is_stealable(lwt_t lwt);
+static int __lwt_pool_push(lwt_t lwt);
+static void __lwt_pool_adopt(lwt_t lwt);
+static void __lwt_pool_schedule();
+static lwt_t __lwt_pool_steal();
+static int __lwt_pool_has_work();
+static void __lwt_pool_wake_one();
+
+static inline void __lwt_reap_dying();
+static void __lwt_die_finalize(lwt_t lwt);
+
+static int		__lwt_stack_class(size_t size);
+static lwt_t	__lwt_tcb_alloc(int cls);
+static void		__lwt_tcb_free(lwt_t lwt);
+static void		__lwt_slab_drain_remote();
 static void		__lwt_main_thread_init();
 static int		__lwt_get_next_threadid();
 
 static inline void		__lwt_create_init_existing(lwt_t lwt, lwt_flags_t flags, lwt_fn_t fn, void* data, lwt_chan_t c);
+static inline void		__lwt_set_name(lwt_t lwt, const char* name);
 static inline void		__lwt_create_init_stack(lwt_t lwt, lwt_fn_t fn, void* data, lwt_chan_t c);
 
 static inline int		__lwt_flags_get_nojoin(lwt_t lwt);
 static inline void		__lwt_flags_set_nojoin(lwt_t lwt);
 
-static inline void		__lwt_snd_buffered(lwt_t sndr, lwt_chan_t c, void* data);
-static inline void*		__lwt_rcv_buffered(lwt_chan_t c);
+static size_t			__lwt_snd_buffered_many(lwt_t sndr, lwt_chan_t c, const void* items, size_t n, lwt_time_t deadline);
+static size_t			__lwt_rcv_buffered_many(lwt_chan_t c, void* out, size_t max, lwt_time_t deadline);
+
+static inline int		__lwt_snd_blocked(lwt_t sndr, lwt_chan_t c, const void* val, lwt_time_t deadline);
+static inline int		__lwt_rcv_blocked(lwt_chan_t c, void* val, lwt_time_t deadline);
 
-static inline void		__lwt_snd_blocked(lwt_t sndr, lwt_chan_t c, void* data);
-static inline void*		__lwt_rcv_blocked(lwt_chan_t c);
+static inline int		__lwt_snd_val(lwt_chan_t c, const void* val, lwt_time_t deadline);
+static inline int		__lwt_rcv_val(lwt_chan_t c, void* val, lwt_time_t deadline);
+static inline void		__lwt_chan_copy(lwt_chan_t c, void* dst, const void* src);
+static inline void		__lwt_chan_handoff(lwt_chan_t c, lwt_t lwt);
 
 static int __lwt_chan_use_buffer(lwt_chan_t c);
 static void __lwt_chan_set_name(lwt_chan_t c, const char* name);
@@ -565,11 +1159,27 @@ static void __lwt_chan_free_snd_buffer(lwt_chan_t c);
 static int __lwt_chan_try_to_free(lwt_chan_t* c);
 
 static inline void __lwt_chan_add_sndr(lwt_chan_t c, lwt_t sndr);
+static inline void __lwt_chan_event(lwt_chan_t c, int dir);
+static inline int __lwt_chan_snd_begin(lwt_chan_t c, lwt_t sndr);
+
+static inline void __lwt_chan_park(struct __lwt_wait_list_t__* list, int* parked, struct __lwt_waiter_t__* w);
+static inline void __lwt_chan_unpark(struct __lwt_wait_list_t__* list, int* parked, struct __lwt_waiter_t__* w);
+static void __lwt_chan_wake(lwt_chan_t c, struct __lwt_wait_list_t__* list, int* parked, size_t n);
+
+static inline void __lwt_spin_lock(int* lock);
+static inline void __lwt_spin_unlock(int* lock);
+static inline void __lwt_chan_lock(lwt_chan_t c);
+static inline void __lwt_chan_unlock(lwt_chan_t c);
+static int __lwt_chan_block_until(lwt_chan_t c, lwt_time_t deadline);
 
 void* __lwt_kthd_entry(void* param);
 void __lwt_kthd_idle();
+void __lwt_kthd_park();
+void* __lwt_pool_worker_entry(void* param);
+int __lwt_pool_free(struct __lwt_pool_t__* pool);
 
 extern void __lwt_trampoline();
+extern void __lwt_ctx_switch(void** save_sp, void* next_sp);
 // =======================================================
 
 int __lwt_flags_get_nojoin(lwt_t lwt)
@@ -583,25 +1193,234 @@ void __lwt_flags_set_nojoin(lwt_t lwt)
 }
 
 /**
- Initialize TCB pool
+ Gets the smallest size class that holds a stack of size bytes.
+ Returns -1 if size is larger than the largest class
  */
-static void __lwt_init_tcb_pool()
+static int __lwt_stack_class(size_t size)
 {
 	int i;
-	for (i=0; i<TCB_POOL_SIZE; i++)
+	for (i=0; i<LWT_STACK_CLASS_NUM; i++)
 	{
-		lwt_queue_inqueue(&__dead_q, __lwt_init_lwt());
+		if (size <= LWT_STACK_CLASS_SIZE(i))
+			return i;
 	}
+	return -1;
 }
 
-lwt_t __lwt_init_lwt()
+/**
+ Gets a TCB without a stack: one whose slab was unmapped, or a new one
+ from the TCB arena.
+ Returns NULL if no memory can be mapped
+ */
+static lwt_t __lwt_tcb_new()
 {
-	lwt_t new_lwt = (struct __lwt_t__*)malloc(sizeof(struct __lwt_t__));
-	// creates stack
-	new_lwt->stack_size = DEFAULT_LWT_STACK_SIZE;
-	new_lwt->stack = malloc(sizeof(void) * new_lwt->stack_size);
-	new_lwt->flags = LWT_F_NONE;
-	return new_lwt;
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	lwt_t lwt = kthd->tcb_free;
+
+	if (lwt)
+	{
+		kthd->tcb_free = lwt->next;
+		return lwt;
+	}
+
+	if (kthd->tcb_arena_end - kthd->tcb_arena < (ptrdiff_t)LWT_TCB_BYTES)
+	{
+		char* chunk = mmap(NULL, LWT_TCB_ARENA_BYTES, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED)
+			return NULL;
+		kthd->tcb_arena = chunk;
+		kthd->tcb_arena_end = chunk + LWT_TCB_ARENA_BYTES;
+	}
+
+	lwt = (lwt_t)kthd->tcb_arena;
+	kthd->tcb_arena += LWT_TCB_BYTES;
+	return lwt;
+}
+
+/**
+ Maps a new slab of size class cls for the current kernel thread.
+ Slots are reserved but only committed when touched (MAP_NORESERVE),
+ and carved into TCBs on demand by __lwt_tcb_alloc().
+ Returns NULL if the mapping fails
+ */
+static struct __lwt_slab_t__* __lwt_slab_new(int cls)
+{
+	size_t i, n = TCB_POOL_BYTES / LWT_STACK_CLASS_SIZE(cls);
+	if (n == 0)
+		n = 1;
+
+	struct __lwt_slab_t__* slab = malloc(sizeof(struct __lwt_slab_t__) + n * sizeof(lwt_t));
+	if (!slab)
+		return NULL;
+
+	// guard page, then the stack
+	slab->slot_size = LWT_STACK_CLASS_SIZE(cls) + __lwt_page_size;
+	slab->size = n * slab->slot_size;
+	slab->base = mmap(NULL, slab->size, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (slab->base == MAP_FAILED)
+	{
+		free(slab);
+		return NULL;
+	}
+
+	// overflowing into a guard page raises SIGSEGV
+	for (i=0; i<n; i++)
+	{
+		if (0 != mprotect(slab->base + i * slab->slot_size, __lwt_page_size, PROT_NONE))
+		{
+			munmap(slab->base, slab->size);
+			free(slab);
+			return NULL;
+		}
+	}
+
+	slab->cls = cls;
+	slab->nslots = n;
+	slab->nfree = n;
+	slab->carved = 0;
+	slab->owner = __current_kthd;
+
+	__current_kthd->slab_bytes += slab->size;
+	__current_kthd->free_bytes += slab->size;
+	return slab;
+}
+
+/**
+ Unmaps a slab whose slots are all free. Its TCBs leave the dead queue
+ for the stackless ones, still marked dead.
+ Returns 0 if a TCB of the slab still has a wakeup in flight; otherwise, 1
+ */
+static int __lwt_slab_release(struct __lwt_slab_t__* slab)
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	size_t i;
+
+	for (i=0; i<slab->carved; i++)
+	{
+		if (__atomic_load_n(&slab->tcbs[i]->inbox_queued, __ATOMIC_ACQUIRE))
+			return 0;
+	}
+
+	for (i=0; i<slab->carved; i++)
+	{
+		lwt_t lwt = slab->tcbs[i];
+		lwt_queue_remove(&__dead_q[slab->cls], lwt);
+		lwt->slab = NULL;
+		lwt->stack = NULL;
+		lwt->next = kthd->tcb_free;
+		kthd->tcb_free = lwt;
+	}
+
+	if (kthd->carving[slab->cls] == slab)
+		kthd->carving[slab->cls] = NULL;
+
+	kthd->slab_bytes -= slab->size;
+	kthd->free_bytes -= slab->size;
+	munmap(slab->base, slab->size);
+	free(slab);
+	return 1;
+}
+
+/**
+ Puts a dead TCB owned by the current kernel thread back into its dead queue.
+ A slab that becomes entirely free is returned to the OS while the
+ kernel thread caches more than the high-water mark
+ */
+static void __lwt_slab_put(lwt_t lwt)
+{
+	struct __lwt_slab_t__* slab = lwt->slab;
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+
+	lwt_queue_inqueue(&__dead_q[slab->cls], lwt);
+	slab->nfree++;
+	kthd->free_bytes += slab->slot_size;
+
+	if (slab->nfree == slab->nslots
+		&& kthd->free_bytes > __atomic_load_n(&__lwt_slab_hwm, __ATOMIC_RELAXED))
+		__lwt_slab_release(slab);
+}
+
+/**
+ Takes back the TCBs freed by other kernel threads
+ */
+static void __lwt_slab_drain_remote()
+{
+	lwt_t lwt = __atomic_exchange_n(&__current_kthd->remote_free, NULL, __ATOMIC_ACQUIRE);
+	while (lwt)
+	{
+		lwt_t next = lwt->next;
+		__lwt_slab_put(lwt);
+		lwt = next;
+	}
+}
+
+/**
+ Gets a TCB with a stack of size class cls: a dead one if possible,
+ otherwise a new one carved from a slab.
+ Returns NULL if no memory can be mapped
+ */
+static lwt_t __lwt_tcb_alloc(int cls)
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	lwt_t lwt;
+
+	if (lwt_queue_empty(&__dead_q[cls]) && __atomic_load_n(&kthd->remote_free, __ATOMIC_RELAXED))
+		__lwt_slab_drain_remote();
+
+	if (!lwt_queue_empty(&__dead_q[cls]))
+		lwt = lwt_queue_dequeue(&__dead_q[cls]);
+	else
+	{
+		struct __lwt_slab_t__* slab = kthd->carving[cls];
+		if (!slab || slab->carved == slab->nslots)
+		{
+			slab = __lwt_slab_new(cls);
+			if (!slab)
+				return NULL;
+			kthd->carving[cls] = slab;
+		}
+
+		lwt = __lwt_tcb_new();
+		if (!lwt)
+			return NULL;
+
+		size_t i = slab->carved++;
+		slab->tcbs[i] = lwt;
+		lwt->slab = slab;
+		lwt->stack_class = cls;
+		lwt->inbox_queued = 0;
+		lwt->stealable = 0;
+		lwt->stack = slab->base + i * slab->slot_size + __lwt_page_size;
+		lwt->stack_size = LWT_STACK_CLASS_SIZE(cls);
+		lwt->flags = LWT_F_NONE;
+	}
+
+	lwt->slab->nfree--;
+	kthd->free_bytes -= lwt->slab->slot_size;
+	return lwt;
+}
+
+/**
+ Frees the TCB of a dead thread. A TCB that belongs to another kernel
+ thread's slab is handed back to it through its remote free list
+ */
+static void __lwt_tcb_free(lwt_t lwt)
+{
+	struct __lwt_kthd_t__* owner = lwt->slab->owner;
+
+	lwt->status = LWT_S_DEAD;
+	if (owner == __current_kthd)
+	{
+		__lwt_slab_put(lwt);
+		return;
+	}
+
+	lwt_t head = __atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+	do
+		lwt->next = head;
+	while (!__atomic_compare_exchange_n(&owner->remote_free, &head, lwt, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
 /**
@@ -609,44 +1428,38 @@ lwt_t __lwt_init_lwt()
  */
 static int __lwt_get_next_threadid()
 {
-	// TODO: use lock-free to do synchronization
-	return __lwt_threadid++;
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+
+	// the shared counter is only touched once per LWT_ID_BLOCK ids
+	if (kthd->id_next == kthd->id_end)
+	{
+		kthd->id_next = __atomic_fetch_add(&__lwt_threadid, LWT_ID_BLOCK, __ATOMIC_RELAXED);
+		kthd->id_end = kthd->id_next + LWT_ID_BLOCK;
+	}
+	return kthd->id_next++;
 }
 
 /**
  Switches from the "current" thread to the "next" thread
- Must be noinline function
+ Only callee-saved registers are saved, see __lwt_ctx_switch
  */
-static void __lwt_dispatch(lwt_t next, lwt_t current)
+static inline void __lwt_dispatch(lwt_t next, lwt_t current)
 {
-	__asm__ __volatile__ (
-						  // Save all registers to stack
-						  "pushal \n\t"							// save the current thread's registers to stack
-						  
-						  // Save stack pointer and base pointer
-						  "leal %c[ebp](%0), %%ebx \n\t"		// %ebx = &(current->ebp)
-						  "movl %%ebp, (%%ebx) \n\t"			// current->ebp = %ebp
-						  "movl %%esp, 0x4(%%ebx) \n\t"			// current->esp = %esp
-						  :
-						  : "r" (current),
-						  LWT_STRUCT_OFFSET(ebp)
-						  :
-						  );
-
-	__asm__ __volatile__ (
-						  // Restore stack pointer and base pointer
-						  "leal %c[ebp](%0), %%ecx \n\t"		// %ecx = &(next->ebp)
-						  "movl (%%ecx), %%ebp \n\t"			// %ebp = next->ebp
-						  "movl 0x4(%%ecx), %%esp \n\t"			// %esp = next->esp
+	if (next == __runnext)
+	{
+		__runnext = NULL;
+		__runnext_streak++;
+	}
+	else
+		__runnext_streak = 0;
 
-						  // Restore registers
-						  "popal \n\t"							// resume the next thread
-						  :
-						  : "r" (next),
-						  LWT_STRUCT_OFFSET(ebp)
-						  :
-						  );
+	// nothing else to run: next->sp is stale, as it is only
+	// saved by the switch below
+	if (next == current)
+		return;
 
+	__lwt_ctx_switch(&current->sp, next->sp);
+	__lwt_reap_dying();
 }
 
 /**
@@ -661,30 +1474,26 @@ void __lwt_main_thread_init()
 	__main_thread->id = 0;
 	__main_thread->status = LWT_S_RUNNING;
 	__main_thread->stack = NULL;
+	__main_thread->stack_class = -1;
+	__main_thread->slab = NULL;
+	__main_thread->inbox_queued = 0;
+	__main_thread->stealable = 0;
+	__main_thread->snd_serial = 0;
+	__main_thread->timer.pprev = NULL;
 	__main_thread->kthd = __current_kthd;
+	__lwt_set_name(__main_thread, "main");
 
 	lwt_queue_inqueue(&__run_q, __main_thread);
 }
 
 /**
  Thread entry, called by __lwt_trampoline in assembly
- This function will return to lwt_die() implicitly.
+ The returned value is passed to lwt_die() by __lwt_trampoline.
  */
-void __lwt_start(lwt_fn_t fn, void* data, lwt_chan_t c)
+void* __lwt_start(lwt_fn_t fn, void* data, lwt_chan_t c)
 {
-	void* ret = fn(data, c);
-	
-	// prepare to return to lwt_die()
-	__asm__ __volatile__ (
-						  // 0x4(%ebp) is the returning address of __lwt_start(), currently pointing to lwt_die()
-						  // 0x8(%ebp) will be the returning address of lwt_die()
-						  // 0xc(%ebp) will be the address of the first parameter used by lwt_die()
-						  "leal (%0), %%ebx \n\t"				// %ebx = ret
-						  "movl %%ebx, 0xc(%%ebp) \n\t"			// 0xc(%ebp) = ret
-						  :
-						  : "r" (ret)
-						  :
-						  );
+	__lwt_reap_dying();
+	return fn(data, c);
 }
 
 void __lwt_create_init_existing(lwt_t lwt, lwt_flags_t flags, lwt_fn_t fn, void* data, lwt_chan_t c)
@@ -696,63 +1505,76 @@ void __lwt_create_init_existing(lwt_t lwt, lwt_flags_t flags, lwt_fn_t fn, void*
 	lwt->flags = flags;
 	lwt->joiner = NULL;
 	lwt->kthd = __current_kthd;
+	lwt->snd_serial = 0;
+	lwt->timer.pprev = NULL;
+	lwt->name[0] = '\0';
 	
 	__lwt_create_init_stack(lwt, fn, data, c);
 	
 	lwt_queue_inqueue(&__run_q, lwt);
 }
 
+void __lwt_set_name(lwt_t lwt, const char* name)
+{
+	if (name)
+	{
+		strncpy(lwt->name, name, LWT_NAME_LEN - 1);
+		lwt->name[LWT_NAME_LEN - 1] = '\0';
+	}
+	else
+		lwt->name[0] = '\0';
+}
+
+/**
+ Builds the initial frame popped by __lwt_ctx_switch, which then
+ "returns" into __lwt_trampoline
+ */
+#if defined(__x86_64__)
+void __lwt_create_init_stack(lwt_t lwt, lwt_fn_t fn, void* data, lwt_chan_t c)
+{
+	// 16-byte aligned top of stack
+	uint64_t* sp = (uint64_t*)(((uintptr_t)lwt->stack + lwt->stack_size) & ~(uintptr_t)0xF);
+
+	// fn/data/c are handed to __lwt_trampoline in r12/r13/r14
+	*(--sp) = (uint64_t)&__lwt_trampoline;	// return address
+	*(--sp) = 0;							// rbp
+	*(--sp) = 0;							// rbx
+	*(--sp) = (uint64_t)fn;					// r12
+	*(--sp) = (uint64_t)data;				// r13
+	*(--sp) = (uint64_t)c;					// r14
+	*(--sp) = 0;							// r15
+	*(--sp) = LWT_INIT_FPU_CW << 32 | LWT_INIT_MXCSR;
+
+	lwt->sp = sp;
+}
+#else
 void __lwt_create_init_stack(lwt_t lwt, lwt_fn_t fn, void* data, lwt_chan_t c)
 {
-	void* lwt_start_stack;
-
-	lwt->ebp = lwt->stack + lwt->stack_size;
-	lwt->esp = lwt->ebp;
-	unsigned int* esp = lwt->esp;
-	
-	*esp = c;
-	esp--;
-	*esp = data;
-	esp--;
-	*esp = fn;
-	esp--;
-	*esp = &lwt_die;
-	esp--;
-	*esp = &__lwt_trampoline;
-	esp--;
-	*esp = lwt->ebp;
-
-	// original esp before pushal
-	lwt_start_stack = esp;
-	esp--;
-	
-	// pushal: eax, ebx, ecx, edx, esp, ebp, esi, edi
-	*esp = 0xB;
-	esp--;
-	*esp = 0x17;
-	esp--;
-	*esp = 0x13;
-	esp--;
-	*esp = 0x55;
-	esp--;
-
-	*esp = lwt_start_stack;
-	esp--;
-	*esp = lwt->ebp;
-	esp--;
-
-	*esp = 0x6;
-	esp--;
-	*esp = 0xA;
-
-	lwt->esp = esp;
+	// 16-byte aligned top of stack
+	uint32_t* sp = (uint32_t*)(((uintptr_t)lwt->stack + lwt->stack_size) & ~(uintptr_t)0xF);
+
+	// arguments of __lwt_start, left on the stack for __lwt_trampoline
+	*(--sp) = 0;							// padding, keeps the call aligned
+	*(--sp) = (uint32_t)c;
+	*(--sp) = (uint32_t)data;
+	*(--sp) = (uint32_t)fn;
+
+	*(--sp) = (uint32_t)&__lwt_trampoline;	// return address
+	*(--sp) = 0;							// ebp
+	*(--sp) = 0;							// ebx
+	*(--sp) = 0;							// esi
+	*(--sp) = 0;							// edi
+
+	lwt->sp = sp;
 }
+#endif
 
 void __lwt_block()
 {
 	lwt_t current_lwt = lwt_queue_dequeue(&__run_q);
 	current_lwt->status = LWT_S_BLOCKED;
-	lwt_queue_inqueue(&__wait_q, current_lwt);
+	__current_kthd->blocked_num++;
+	__lwt_kthd_drain();
 	
 	lwt_t next_lwt = lwt_queue_peek(&__run_q);
 	next_lwt->status = LWT_S_RUNNING;
@@ -760,169 +1582,1332 @@ void __lwt_block()
 	__lwt_dispatch(next_lwt, current_lwt);
 }
 
-void __lwt_block_and_wakeup(lwt_t lwt)
+/**
+ Blocks the current thread until it is woken up, or until deadline.
+ Returns 0 if woken up; -1 if the deadline has passed. Either way the
+ caller re-checks its condition, as both may have happened.
+ */
+int __lwt_block_until(lwt_time_t deadline)
 {
-	lwt_t current_lwt = lwt_queue_dequeue(&__run_q);
-	current_lwt->status = LWT_S_BLOCKED;
-	lwt_queue_inqueue(&__wait_q, current_lwt);
-
-	lwt_t next_lwt;
-	// the lwt is on the same kernal thread
-	if (lwt->kthd == __current_kthd)
-	{
-		if (lwt->status == LWT_S_BLOCKED)
-			lwt_queue_remove(&__wait_q, lwt);
-		else
-			lwt_queue_remove(&__run_q, lwt);
-		
-		lwt_queue_insert_before(&__run_q, lwt_queue_peek(&__run_q), lwt);
-		lwt->status = LWT_S_READY;
-		next_lwt = lwt;
-	}
-	// the lwt is on another kernal thread
-	else
+	if (deadline == LWT_DEADLINE_NEVER)
 	{
-		next_lwt = lwt_queue_peek(&__run_q);
-		next_lwt->status = LWT_S_RUNNING;
-
-		__lwt_kthd_wakeup(lwt->kthd, lwt);
-		
+		__lwt_block();
+		return 0;
 	}
 
-	__lwt_dispatch(next_lwt, current_lwt);
-}
+	lwt_t lwt = __lwt_current_inline();
+	if (deadline <= __lwt_now())
+		return -1;
 
-void __lwt_wakeup(lwt_t blocked_lwt)
-{
-	if (blocked_lwt->status == LWT_S_BLOCKED)
+	__lwt_timer_add(lwt, deadline);
+	__lwt_block();
+	// still armed: somebody else woke us up
+	if (timer_wheel_pending(&lwt->timer))
 	{
-		// blocked_lwt is on the same kernal thread
-		if (blocked_lwt->kthd == __current_kthd)
-		{
-			lwt_queue_remove(&__wait_q, blocked_lwt);
-			blocked_lwt->status = LWT_S_READY;
-			lwt_queue_inqueue(&__run_q, blocked_lwt);
-		}
-		// blocked_lwt is on another kernal thread
-		else
-		{
-			__lwt_kthd_wakeup(blocked_lwt->kthd, blocked_lwt);
-		}
+		__lwt_timer_remove(lwt);
+		return 0;
 	}
+	return -1;
 }
 
-void __lwt_wakeup_all()
+lwt_time_t __lwt_now()
 {
-	while (lwt_queue_size(&__wait_q) > 0)
-	{
-		lwt_t blocked_lwt = lwt_queue_dequeue(&__wait_q);
-		blocked_lwt->status = LWT_S_READY;
-		lwt_queue_inqueue(&__run_q, blocked_lwt);
-	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (lwt_time_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void __lwt_kthd_wakeup(struct __lwt_kthd_t__* kthd, lwt_t blocked_lwt)
+/**
+ Deadline of an operation that times out in timeout ns from now
+ */
+lwt_time_t __lwt_deadline(lwt_time_t timeout)
 {
-	// TODO:
+	lwt_time_t now = __lwt_now();
+	if (timeout >= LWT_DEADLINE_NEVER - now)
+		return LWT_DEADLINE_NEVER;
+	return now + timeout;
 }
 
-// =======================================================
-
-void* __lwt_kthd_entry(void* param)
+/**
+ Arms the timer of lwt, of the current kernel thread, for deadline
+ */
+void __lwt_timer_add(lwt_t lwt, lwt_time_t deadline)
 {
-	__lwt_main_thread_init();
-
-	struct __lwt_kthd_entry_param_t__* p = param;
-
-	__current_kthd = p->kthd;
-	__idle_thread = __lwt_current_inline();
-	
-	debug_print("%p: creating lwt.....", lwt_current());
-	__lwt_create_init_existing(p->lwt, LWT_F_NOJOIN, p->fn, p->data, p->c);
-	p->lwt->kthd = p->kthd;
-	debug_print("%p: new lwt %p created.\n", lwt_current(), p->lwt);
-
-	free(param);
-	
-	__lwt_kthd_idle();
+	// rounded up: the timer never fires before deadline
+	lwt_time_t tick = (deadline >> LWT_TIMER_TICK_SHIFT) + !!(deadline & ((1ULL << LWT_TIMER_TICK_SHIFT) - 1));
+	timer_wheel_add(__current_kthd->timers, &lwt->timer, tick);
+	__current_kthd->timer_num++;
+}
 
-	return NULL;
+/**
+ Disarms the timer of lwt
+ */
+void __lwt_timer_remove(lwt_t lwt)
+{
+	timer_wheel_remove(__current_kthd->timers, &lwt->timer);
+	__current_kthd->timer_num--;
 }
 
-void __lwt_kthd_idle()
+/**
+ Readies the blocked lwts whose deadline has passed. A lwt that is not
+ blocked any more has been woken up already and just loses its timer
+ */
+void __lwt_timer_expire()
 {
-//	debug_print("%p: __lwt_kthd_idle in pthread %p. \n", lwt_current(), pthread_self());
-	while(1)
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	timer_wheel_node_t* n = timer_wheel_advance(kthd->timers, __lwt_now() >> LWT_TIMER_TICK_SHIFT);
+
+	while (n)
 	{
-		lwt_yield(LWT_NULL);
+		lwt_t lwt = (lwt_t)((char*)n - offsetof(struct __lwt_t__, timer));
+		n = n->next;
+		kthd->timer_num--;
+		if (lwt->status == LWT_S_BLOCKED)
+			__lwt_ready(lwt);
 	}
 }
 
-int lwt_kthd_create(lwt_fn_t fn, void* data, lwt_chan_t c)
+void __lwt_wakeup(lwt_t blocked_lwt)
 {
-	struct __lwt_kthd_entry_param_t__* param = malloc(sizeof(struct __lwt_kthd_entry_param_t__));
-	if (!param)
-		return -1;
-
-	param->kthd = malloc(sizeof(struct __lwt_kthd_t__));
-	if (!param->kthd)
-		return -1;
-
-	pthread_attr_t attr;
-	if (0 != pthread_attr_init(&attr))
-		return -1;
-
-	if (0 != pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
-		return -1;
-
-	param->lwt = __lwt_init_lwt();
-	param->fn = fn;
-	param->data = data;
-	param->c = c;
-	
-	if (c)
+	// blocked_lwt is on the same kernal thread
+	if (blocked_lwt->kthd == __current_kthd)
 	{
-		__lwt_chan_add_sndr(c, __lwt_current_inline());
-		c->receiver = param->lwt;
+		if (blocked_lwt->status == LWT_S_BLOCKED)
+			__lwt_ready_next(blocked_lwt);
+	}
+	// blocked_lwt is on another kernal thread.
+	// Its status cannot be trusted from here, as it may be just about to block,
+	// so always post it; its own kernel thread checks the status when draining.
+	else
+	{
+		__lwt_kthd_wakeup(blocked_lwt->kthd, blocked_lwt);
 	}
-	
-	debug_print("%p: create pthread. Current pthread: %p\n", lwt_current(), pthread_self());
-	if (0 != pthread_create(&param->kthd->pthread_id, &attr, &__lwt_kthd_entry, param))
-		return -1;
-	
-	pthread_attr_destroy(&attr);
-	return 0;
 }
 
 /**
- Creates a lwt thread, with the entry function pointer fn,
- and the parameter pointer data used by fn
- Returns lwt_t type
+ Moves a blocked lwt of the current kernel thread to the run queue
  */
-lwt_t lwt_create(lwt_fn_t fn, void* data, lwt_flags_t flags, lwt_chan_t c)
+void __lwt_ready(lwt_t lwt)
 {
-	if (lwt_queue_size(&__dead_q) == 0)
-		__lwt_init_tcb_pool();
-		
-	lwt_t new_lwt = lwt_queue_dequeue(&__dead_q);
+	lwt->status = LWT_S_READY;
+	__current_kthd->blocked_num--;
+	lwt_queue_inqueue(&__run_q, lwt);
+}
+
+/**
+ Moves a blocked lwt of the current kernel thread to the run queue,
+ right behind the current thread, unless __runnext has been switched
+ to LWT_RUNNEXT_MAX times in a row. The previous __runnext, if it has
+ not run yet, goes back to the tail
+ */
+void __lwt_ready_next(lwt_t lwt)
+{
+	lwt_t head = lwt_queue_peek(&__run_q);
+	if (__runnext_streak >= LWT_RUNNEXT_MAX || !head || head->next == head)
+	{
+		__lwt_ready(lwt);
+		return;
+	}
+
+	if (__runnext && __runnext != head && __runnext->status == LWT_S_READY && __runnext->queue == &__run_q)
+	{
+		lwt_queue_remove(&__run_q, __runnext);
+		lwt_queue_inqueue(&__run_q, __runnext);
+	}
+
+	lwt->status = LWT_S_READY;
+	__current_kthd->blocked_num--;
+	lwt_queue_insert_before(&__run_q, head->next, lwt);
+	__runnext = lwt;
+}
+
+/**
+ Returns 0 on success; otherwise -1, and whatever was allocated is left for
+ __lwt_kthd_fini()
+ */
+int __lwt_kthd_init(struct __lwt_kthd_t__* kthd)
+{
+	kthd->message_queue = mpsc_queue_init();
+	kthd->zombie_num = 0;
+	kthd->blocked_num = 0;
+	kthd->parked = 0;
+	kthd->park_num = 0;
+	kthd->run_deque = NULL;
+	kthd->steal_next = 0;
+	kthd->id_next = 0;
+	kthd->id_end = 0;
+	kthd->remote_free = NULL;
+	memset(kthd->carving, 0, sizeof(kthd->carving));
+	kthd->tcb_free = NULL;
+	kthd->tcb_arena = NULL;
+	kthd->tcb_arena_end = NULL;
+	kthd->slab_bytes = 0;
+	kthd->free_bytes = 0;
+	kthd->timers = timer_wheel_init(__lwt_now() >> LWT_TIMER_TICK_SHIFT);
+	kthd->timer_num = 0;
+	kthd->epfd = -1;
+	kthd->evfd = -1;
+	kthd->pollfds = NULL;
+	kthd->pollfd_cap = 0;
+	kthd->poll_num = 0;
+	kthd->uring = NULL;
+	kthd->uring_tried = 0;
+	kthd->io_num = 0;
+	kthd->helpers_wanted = 0;
+
+	return kthd->message_queue && kthd->timers ? 0 : -1;
+}
+
+/**
+ Frees what __lwt_kthd_init() allocated, for a kernel thread that never ran
+ */
+void __lwt_kthd_fini(struct __lwt_kthd_t__* kthd)
+{
+	mpsc_queue_free(&kthd->message_queue);
+	timer_wheel_free(&kthd->timers);
+}
+
+/**
+ Posts blocked_lwt to the message queue of kthd, which owns it.
+ Lock-free and allocation-free; a lwt already in a queue is not queued
+ twice, as the pending entry wakes it up anyway.
+ */
+void __lwt_kthd_wakeup(struct __lwt_kthd_t__* kthd, lwt_t blocked_lwt)
+{
+	// a full barrier: our writes to the wakeup condition are visible
+	// before the owner can clear the flag and look at the lwt
+	if (__atomic_exchange_n(&blocked_lwt->inbox_queued, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	mpsc_queue_push(kthd->message_queue, &blocked_lwt->inbox_node);
+
+	// pairs with the fence in __lwt_kthd_park(): either the owner sees
+	// our message, or we see it parked
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	__lwt_kthd_unpark(kthd);
+}
+
+/**
+ Wakes kthd up if it sleeps in __lwt_kthd_park().
+ Returns 1 if it did; otherwise, 0
+ */
+int __lwt_kthd_unpark(struct __lwt_kthd_t__* kthd)
+{
+	if (!__atomic_load_n(&kthd->parked, __ATOMIC_RELAXED))
+		return 0;
+
+	int parked = __atomic_exchange_n(&kthd->parked, 0, __ATOMIC_RELAXED);
+	if (parked == LWT_KTHD_PARKED_FUTEX)
+		syscall(SYS_futex, &kthd->parked, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	else if (parked == LWT_KTHD_PARKED_POLL)
+	{
+		uint64_t one = 1;
+		if (write(kthd->evfd, &one, sizeof(one)) < 0)
+		{
+			debug_print("%p: __lwt_kthd_unpark: eventfd write failed.\n", lwt_current());
+		}
+	}
+	return parked != 0;
+}
+
+/**
+ Puts the current kernel thread to sleep until a message is posted
+ to its message queue, or until its earliest timer is due. While lwts
+ wait on fds or files, it sleeps in the netpoller instead of on the
+ futex, so that fd readiness and io_uring completions wake it up as well.
+ Only called by the idle thread
+ */
+void __lwt_kthd_park()
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	int pooled = kthd->run_deque != NULL;
+	struct timespec ts, *timeout = NULL;
+
+	if (kthd->timer_num)
+	{
+		lwt_time_t now = __lwt_now(), deadline = timer_wheel_next(kthd->timers) << LWT_TIMER_TICK_SHIFT;
+		if (deadline <= now)
+			return;
+		ts.tv_sec = (deadline - now) / 1000000000ULL;
+		ts.tv_nsec = (deadline - now) % 1000000000ULL;
+		timeout = &ts;
+	}
+
+	int mode = kthd->poll_num || kthd->io_num ? LWT_KTHD_PARKED_POLL : LWT_KTHD_PARKED_FUTEX;
+	__atomic_store_n(&kthd->parked, mode, __ATOMIC_RELAXED);
+	if (pooled)
+		__atomic_fetch_add(&__lwt_pool->parked_num, 1, __ATOMIC_RELAXED);
+	// pairs with the fences in __lwt_kthd_wakeup() and __lwt_pool_push()
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	// sleeps only if parked is still set; spurious returns are fine,
+	// the idle loop simply drains and parks again
+	while (mpsc_queue_empty(kthd->message_queue)
+		   && !(pooled && __lwt_pool_has_work())
+		   && __atomic_load_n(&kthd->parked, __ATOMIC_RELAXED))
+	{
+		kthd->park_num++;
+		if (mode == LWT_KTHD_PARKED_POLL)
+		{
+			__lwt_netpoll(timeout);
+			break;
+		}
+		if (syscall(SYS_futex, &kthd->parked, FUTEX_WAIT_PRIVATE, LWT_KTHD_PARKED_FUTEX, timeout, NULL, 0) == -1
+			&& errno == ETIMEDOUT)
+			break;
+	}
+
+	__atomic_store_n(&kthd->parked, 0, __ATOMIC_RELAXED);
+	if (pooled)
+		__atomic_fetch_sub(&__lwt_pool->parked_num, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ Drains the message queue, expires the timers and reaps the io_uring
+ completions, called at every scheduling point
+ */
+void __lwt_kthd_drain()
+{
+	if (!mpsc_queue_empty(__current_kthd->message_queue))
+		__lwt_kthd_drain_batch();
+	if (__current_kthd->timer_num)
+		__lwt_timer_expire();
+	if (__current_kthd->io_num)
+		__lwt_io_reap();
+}
+
+/**
+ Moves the lwts posted by other kernel threads into the run queue.
+ An lwt that is no longer blocked by the time it is drained has not
+ gone to sleep yet; it re-checks its condition before blocking, so
+ the wakeup can be dropped.
+ */
+void __lwt_kthd_drain_batch()
+{
+	mpsc_queue_t* mq = __current_kthd->message_queue;
+	mpsc_node_t* n;
+
+	while ((n = mpsc_queue_pop(mq)))
+	{
+		lwt_t lwt = (lwt_t)((char*)n - offsetof(struct __lwt_t__, inbox_node));
+		__atomic_exchange_n(&lwt->inbox_queued, 0, __ATOMIC_SEQ_CST);
+
+		// still in a work-stealing deque: whoever takes it runs it
+		if (__lwt_is_stealable(lwt))
+			continue;
+
+		// a stale wakeup of a recycled TCB that now lives elsewhere
+		if (lwt->kthd != __current_kthd)
+		{
+			__lwt_kthd_wakeup(lwt->kthd, lwt);
+			continue;
+		}
+
+		// created by lwt_create_attr() on another kernel thread
+		if (lwt->status == LWT_S_CREATED)
+		{
+			lwt->status = LWT_S_READY;
+			lwt_queue_inqueue(&__run_q, lwt);
+		}
+		else if (lwt->status == LWT_S_BLOCKED)
+			__lwt_ready(lwt);
+	}
+}
+
+/**
+ Returns 1 if lwt waits in a work-stealing deque. Once it returns 0,
+ lwt->kthd is the kernel thread that took it
+ */
+int __lwt_is_stealable(lwt_t lwt)
+{
+	return __atomic_load_n(&lwt->stealable, __ATOMIC_ACQUIRE);
+}
+
+/**
+ Pushes a new lwt into the deque of the current pool worker,
+ waking up a parked worker to steal it if there is one.
+ Returns -1 if the deque cannot grow; otherwise, 0
+ */
+int __lwt_pool_push(lwt_t lwt)
+{
+	lwt->status = LWT_S_CREATED;
+	lwt->stealable = 1;
+	if (0 != ws_deque_push(__current_kthd->run_deque, lwt))
+	{
+		lwt->stealable = 0;
+		lwt->status = LWT_S_READY;
+		return -1;
+	}
+
+	// pairs with the fence in __lwt_kthd_park(): either the worker
+	// sees our lwt, or we see it parked
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&__lwt_pool->parked_num, __ATOMIC_RELAXED))
+		__lwt_pool_wake_one();
+	return 0;
+}
+
+/**
+ Moves a lwt taken from a deque into the run queue of the current kernel thread
+ */
+void __lwt_pool_adopt(lwt_t lwt)
+{
+	lwt->kthd = __current_kthd;
+	lwt->status = LWT_S_READY;
+	// publishes the new kthd to __lwt_is_stealable()
+	__atomic_store_n(&lwt->stealable, 0, __ATOMIC_RELEASE);
+	lwt_queue_inqueue(&__run_q, lwt);
+}
+
+/**
+ Called by the idle thread of a pool worker: takes a batch of lwts from
+ its own deque, or steals one when it has nothing else to run
+ */
+void __lwt_pool_schedule()
+{
+	ws_deque_t* dq = __current_kthd->run_deque;
+	lwt_t lwt;
+	int i;
+
+	for (i = 0; i < LWT_POOL_BATCH && (lwt = ws_deque_pop(dq)); i++)
+		__lwt_pool_adopt(lwt);
+
+	if (lwt_queue_size(&__run_q) == 1 && (lwt = __lwt_pool_steal()))
+		__lwt_pool_adopt(lwt);
+}
+
+/**
+ Steals the oldest lwt of another worker, visiting them round-robin.
+ Returns NULL if there is nothing to steal
+ */
+lwt_t __lwt_pool_steal()
+{
+	struct __lwt_pool_t__* pool = __lwt_pool;
+	size_t i, start = __current_kthd->steal_next++;
+
+	for (i = 0; i < pool->size; i++)
+	{
+		struct __lwt_kthd_t__* victim = pool->workers[(start + i) % pool->size];
+		if (victim == __current_kthd)
+			continue;
+
+		lwt_t lwt = ws_deque_steal(victim->run_deque);
+		if (lwt)
+			return lwt;
+	}
+	return NULL;
+}
+
+int __lwt_pool_has_work()
+{
+	size_t i;
+	for (i = 0; i < __lwt_pool->size; i++)
+	{
+		if (ws_deque_size(__lwt_pool->workers[i]->run_deque) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+void __lwt_pool_wake_one()
+{
+	size_t i;
+	for (i = 0; i < __lwt_pool->size; i++)
+	{
+		if (__lwt_kthd_unpark(__lwt_pool->workers[i]))
+			return;
+	}
+}
+
+// =======================================================
+
+/**
+ Sets up the netpoller of the current kernel thread, if not done yet.
+ Returns 0 if succeeded; otherwise, -1
+ */
+int __lwt_netpoll_init()
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	if (kthd->epfd >= 0)
+		return 0;
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = -1 };
+	kthd->epfd = epoll_create1(EPOLL_CLOEXEC);
+	kthd->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (kthd->epfd < 0 || kthd->evfd < 0
+		|| epoll_ctl(kthd->epfd, EPOLL_CTL_ADD, kthd->evfd, &ev) < 0)
+	{
+		if (kthd->epfd >= 0)
+			close(kthd->epfd);
+		if (kthd->evfd >= 0)
+			close(kthd->evfd);
+		kthd->epfd = kthd->evfd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ Gets the poll state of fd in the netpoller of the current kernel thread.
+ The first time, the netpoller is set up if needed, fd is registered
+ and made non-blocking; so is a fd found blocking later on, as its number
+ may have been reused after a close() without lwt_close().
+ Returns NULL if any of this fails
+ */
+struct __lwt_pollfd_t__* __lwt_pollfd(int fd)
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	if (fd < 0)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+
+	if (__lwt_netpoll_init())
+		return NULL;
+
+	if ((size_t)fd >= kthd->pollfd_cap)
+	{
+		size_t cap = kthd->pollfd_cap ? kthd->pollfd_cap : 64;
+		while (cap <= (size_t)fd)
+			cap <<= 1;
+		struct __lwt_pollfd_t__* pollfds = realloc(kthd->pollfds, sizeof(struct __lwt_pollfd_t__) * cap);
+		if (!pollfds)
+			return NULL;
+		memset(pollfds + kthd->pollfd_cap, 0, sizeof(struct __lwt_pollfd_t__) * (cap - kthd->pollfd_cap));
+		kthd->pollfds = pollfds;
+		kthd->pollfd_cap = cap;
+	}
+
+	struct __lwt_pollfd_t__* pfd = &kthd->pollfds[fd];
+	int flags = 0;
+	if (pfd->registered)
+	{
+		flags = fcntl(fd, F_GETFL);
+		if (flags < 0)
+			return NULL;
+		if (pfd->registered > 0 && (flags & O_NONBLOCK))
+			return pfd;
+	}
+
+	// fd may still be registered, if only its O_NONBLOCK was cleared
+	struct epoll_event ev = { .events = LWT_POLL_EVENTS, .data.fd = fd };
+	if (epoll_ctl(kthd->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+	{
+		if (errno != EPERM)
+			return NULL;
+		pfd->registered = -1;
+		return pfd;
+	}
+
+	if (!pfd->registered)
+		flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+	{
+		epoll_ctl(kthd->epfd, EPOLL_CTL_DEL, fd, NULL);
+		pfd->registered = 0;
+		return NULL;
+	}
+
+	// epoll reports the current readiness of fd right away
+	pfd->rready = pfd->wready = 0;
+	pfd->registered = 1;
+	return pfd;
+}
+
+/**
+ Blocks the current thread until fd becomes readable (or writable, if
+ write is set), unless it has since the last wait. Callers retry their
+ I/O afterwards, as readiness is only a hint.
+ Returns -1 if fd cannot be polled; otherwise, 0
+ */
+int __lwt_poll_wait(int fd, int write)
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	struct __lwt_pollfd_t__* pfd = __lwt_pollfd(fd);
+	if (!pfd || pfd->registered < 0)
+		return -1;
+
+	int* ready = write ? &pfd->wready : &pfd->rready;
+	if (!*ready)
+	{
+		// a close() without lwt_close() drops fd from epfd, and its number
+		// may now name another file: registered again if so. Also re-arms
+		// the edge, in case fd became ready since the failed I/O
+		struct epoll_event ev = { .events = LWT_POLL_EVENTS, .data.fd = fd };
+		if (epoll_ctl(kthd->epfd, EPOLL_CTL_MOD, fd, &ev) < 0
+			&& (errno != ENOENT || epoll_ctl(kthd->epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+			return -1;
+
+		lwt_t lwt = __lwt_current_inline();
+		if (write)
+			pfd->writer = lwt;
+		else
+			pfd->reader = lwt;
+
+		kthd->poll_num++;
+		__lwt_block();
+		kthd->poll_num--;
+
+		// pfd may have moved while the table grew
+		pfd = &kthd->pollfds[fd];
+		if (write && pfd->writer == lwt)
+			pfd->writer = NULL;
+		else if (!write && pfd->reader == lwt)
+			pfd->reader = NULL;
+		ready = write ? &pfd->wready : &pfd->rready;
+	}
+	*ready = 0;
+	return 0;
+}
+
+/**
+ Waits for fd events for timeout at most (NULL: until there is one),
+ and readies the lwts blocked on the fds that became ready
+ */
+void __lwt_netpoll(const struct timespec* timeout)
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	struct epoll_event evs[LWT_POLL_BATCH];
+	int i, n = -1;
+
+#ifdef SYS_epoll_pwait2
+	// shared by every kernel thread
+	static int no_pwait2 = 0;
+	int pwait2 = !__atomic_load_n(&no_pwait2, __ATOMIC_RELAXED);
+	if (pwait2)
+	{
+		n = syscall(SYS_epoll_pwait2, kthd->epfd, evs, LWT_POLL_BATCH, timeout, NULL, 0);
+		if (n < 0 && errno == ENOSYS)
+		{
+			__atomic_store_n(&no_pwait2, 1, __ATOMIC_RELAXED);
+			pwait2 = 0;
+		}
+	}
+	if (!pwait2)
+#endif
+	{
+		// rounded up to ms: never returns before a timer is due
+		int ms = timeout ? (int)(timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000) : -1;
+		n = epoll_wait(kthd->epfd, evs, LWT_POLL_BATCH, ms);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		int fd = evs[i].data.fd;
+		uint32_t e = evs[i].events;
+		if (fd < 0)
+		{
+			// unparked by __lwt_kthd_unpark(), or by io_uring completions
+			uint64_t cnt;
+			if (read(kthd->evfd, &cnt, sizeof(cnt)) < 0)
+			{
+				debug_print("%p: __lwt_netpoll: eventfd read failed.\n", lwt_current());
+			}
+			continue;
+		}
+
+		struct __lwt_pollfd_t__* pfd = &kthd->pollfds[fd];
+		if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		{
+			pfd->rready = 1;
+			if (pfd->reader)
+				__lwt_wakeup(pfd->reader);
+		}
+		if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+		{
+			pfd->wready = 1;
+			if (pfd->writer)
+				__lwt_wakeup(pfd->writer);
+		}
+	}
+}
+
+ssize_t lwt_read(int fd, void* buf, size_t count)
+{
+	// non-blocking before the first call
+	if (!__lwt_pollfd(fd))
+		return -1;
+
+	while (1)
+	{
+		ssize_t n = read(fd, buf, count);
+		if (n >= 0)
+			return n;
+		if (errno == EINTR)
+			continue;
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || __lwt_poll_wait(fd, 0))
+			return -1;
+	}
+}
+
+ssize_t lwt_write(int fd, const void* buf, size_t count)
+{
+	// non-blocking before the first call
+	if (!__lwt_pollfd(fd))
+		return -1;
+
+	while (1)
+	{
+		ssize_t n = write(fd, buf, count);
+		if (n >= 0)
+			return n;
+		if (errno == EINTR)
+			continue;
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || __lwt_poll_wait(fd, 1))
+			return -1;
+	}
+}
+
+int lwt_accept(int fd, struct sockaddr* addr, socklen_t* addrlen)
+{
+	if (!__lwt_pollfd(fd))
+		return -1;
+
+	while (1)
+	{
+		int s = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (s >= 0)
+			return s;
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || __lwt_poll_wait(fd, 0))
+			return -1;
+	}
+}
+
+int lwt_connect(int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+	if (!__lwt_pollfd(fd))
+		return -1;
+
+	if (connect(fd, addr, addrlen) == 0)
+		return 0;
+	if (errno != EINPROGRESS && errno != EINTR)
+		return -1;
+
+	// connected, or failed, once the socket is writable
+	int err = 0;
+	socklen_t len = sizeof(err);
+	do
+	{
+		if (__lwt_poll_wait(fd, 1) || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			return -1;
+	} while (err == EINPROGRESS || err == EALREADY);
+
+	if (err)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int lwt_close(int fd)
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	if (fd >= 0 && (size_t)fd < kthd->pollfd_cap && kthd->pollfds[fd].registered)
+	{
+		struct __lwt_pollfd_t__* pfd = &kthd->pollfds[fd];
+		if (pfd->registered > 0)
+			epoll_ctl(kthd->epfd, EPOLL_CTL_DEL, fd, NULL);
+		// waiters retry their I/O, and fail on the closed fd
+		if (pfd->reader)
+			__lwt_wakeup(pfd->reader);
+		if (pfd->writer)
+			__lwt_wakeup(pfd->writer);
+		memset(pfd, 0, sizeof(struct __lwt_pollfd_t__));
+	}
+	return close(fd);
+}
+
+// =======================================================
+
+void __lwt_helpers_init()
+{
+	struct __lwt_helpers_t__* helpers = malloc(sizeof(struct __lwt_helpers_t__));
+	if (!helpers)
+		return;
+
+	helpers->jobs = mpmc_queue_init(LWT_HELPER_QUEUE, sizeof(struct __lwt_helper_job_t__*));
+	helpers->seq = 0;
+	helpers->idle_num = 0;
+	helpers->helper_num = 0;
+	if (!helpers->jobs)
+	{
+		free(helpers);
+		return;
+	}
+
+	// at least one helper, so that a queued job always runs
+	if (__lwt_helper_start(helpers))
+		__atomic_store_n(&__lwt_helpers, helpers, __ATOMIC_RELEASE);
+	else
+	{
+		mpmc_queue_free(&helpers->jobs);
+		free(helpers);
+	}
+	__atomic_store_n(&__lwt_helpers_tried, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ Starts one more helper thread, unless there are LWT_HELPER_MAX.
+ Returns 1 if it did; otherwise, 0
+ */
+int __lwt_helper_start(struct __lwt_helpers_t__* helpers)
+{
+	int n = __atomic_load_n(&helpers->helper_num, __ATOMIC_RELAXED);
+	do
+	{
+		if (n >= LWT_HELPER_MAX)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&helpers->helper_num, &n, n + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	pthread_attr_t attr;
+	pthread_t tid;
+	int ret = 0;
+	if (0 == pthread_attr_init(&attr))
+	{
+		ret = 0 == pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)
+			&& 0 == pthread_create(&tid, &attr, &__lwt_helper_entry, helpers);
+		pthread_attr_destroy(&attr);
+	}
+
+	if (!ret)
+		__atomic_fetch_sub(&helpers->helper_num, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+void* __lwt_helper_entry(void* param)
+{
+	struct __lwt_helpers_t__* helpers = param;
+	struct __lwt_helper_job_t__* job;
+
+	while (1)
+	{
+		int seq = __atomic_load_n(&helpers->seq, __ATOMIC_SEQ_CST);
+		if (mpmc_queue_pop(helpers->jobs, &job))
+		{
+			// this job may block for long: keep a helper idle for the next
+			// one. Started from here, as a lwt stack may be too small for
+			// pthread_create()
+			if (!__atomic_load_n(&helpers->idle_num, __ATOMIC_SEQ_CST))
+				__lwt_helper_start(helpers);
+
+			lwt_t lwt = job->lwt;
+			struct __lwt_kthd_t__* kthd = lwt->kthd;
+			job->ret = job->fn(job->arg);
+
+			// job lives on the stack of lwt, which may return, and even die,
+			// as soon as it sees done: its inbox is claimed before, so that
+			// our push is all that touches the TCB afterwards. A pending
+			// entry may be drained before done is set, so wait for it
+			int spin = 0;
+			while (__atomic_exchange_n(&lwt->inbox_queued, 1, __ATOMIC_SEQ_CST))
+			{
+				if (++spin >= LWT_KTHD_IDLE_SPIN)
+				{
+					spin = 0;
+					sched_yield();
+				}
+				else
+					__builtin_ia32_pause();
+			}
+			__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+
+			mpsc_queue_push(kthd->message_queue, &lwt->inbox_node);
+			// pairs with the fence in __lwt_kthd_park(), see __lwt_kthd_wakeup()
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			__lwt_kthd_unpark(kthd);
+			continue;
+		}
+
+		// pairs with lwt_offload(): either it sees us idle, or we see
+		// seq changed and do not sleep
+		__atomic_fetch_add(&helpers->idle_num, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &helpers->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+		__atomic_fetch_sub(&helpers->idle_num, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+void* lwt_offload(void* (*fn)(void*), void* arg)
+{
+	// the first helper is started by the idle thread, for the same reason
+	// as in __lwt_helper_entry()
+	while (!__atomic_load_n(&__lwt_helpers_tried, __ATOMIC_ACQUIRE))
+	{
+		__current_kthd->helpers_wanted = 1;
+		lwt_yield(LWT_NULL);
+	}
+	struct __lwt_helpers_t__* helpers = __atomic_load_n(&__lwt_helpers, __ATOMIC_ACQUIRE);
+	if (!helpers)
+		return fn(arg);
+
+	struct __lwt_helper_job_t__ job = { fn, arg, NULL, __lwt_current_inline(), 0 };
+	struct __lwt_helper_job_t__* pjob = &job;
+
+	// full: let the kernel thread run something else meanwhile
+	while (!mpmc_queue_push(helpers->jobs, &pjob))
+		lwt_yield(LWT_NULL);
+
+	__atomic_fetch_add(&helpers->seq, 1, __ATOMIC_SEQ_CST);
+	// if none is idle, the helper that took the last job is starting one
+	if (__atomic_load_n(&helpers->idle_num, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &helpers->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+
+	// a wakeup that comes before we block is dropped by the drain, and
+	// done is set by then
+	while (!__atomic_load_n(&job.done, __ATOMIC_ACQUIRE))
+		__lwt_block();
+	return job.ret;
+}
+
+// =======================================================
+
+/**
+ Runs a file operation with a blocking system call, on a helper thread
+ */
+void* __lwt_io_sync(void* param)
+{
+	struct __lwt_io_t__* io = param;
+	ssize_t res;
+
+	if (io->op == IORING_OP_READ)
+		res = pread(io->fd, io->buf, io->count, io->offset);
+	else if (io->op == IORING_OP_WRITE)
+		res = pwrite(io->fd, io->buf, io->count, io->offset);
+	else
+		res = fsync(io->fd);
+
+	io->res = res < 0 ? -errno : res;
+	return NULL;
+}
+
+/**
+ Runs a file operation without blocking the kernel thread: queued to
+ its io_uring, submitted by the idle thread together with the others
+ of the round; or, if there is no io_uring (or if built with
+ LWT_NO_URING), run by a helper thread.
+ Returns the result of the system call, setting errno on errors
+ */
+ssize_t __lwt_io(struct __lwt_io_t__* io)
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+#ifndef LWT_NO_URING
+	if (!kthd->uring_tried)
+	{
+		kthd->uring_tried = 1;
+		if (!__lwt_netpoll_init() && (kthd->uring = uring_init(LWT_URING_ENTRIES))
+			&& uring_register_eventfd(kthd->uring, kthd->evfd))
+			uring_free(&kthd->uring);
+	}
+#endif
+
+	io->lwt = __lwt_current_inline();
+	io->done = 0;
+	if (!kthd->uring)
+		lwt_offload(__lwt_io_sync, io);
+	else
+	{
+		// never more in flight than the completion ring holds
+		while (kthd->io_num >= uring_cq_entries(kthd->uring))
+			lwt_yield(LWT_NULL);
+
+		// lengths are 32 bits: a partial transfer, as read(2) may do
+		unsigned int len = io->count > 0x7ffff000 ? 0x7ffff000 : io->count;
+		while (uring_prep(kthd->uring, io->op, io->fd, io->buf, len, io->offset, io))
+			uring_submit(kthd->uring);
+
+		kthd->io_num++;
+		while (!io->done)
+			__lwt_block();
+	}
+
+	if (io->res < 0)
+	{
+		errno = -io->res;
+		return -1;
+	}
+	return io->res;
+}
+
+/**
+ Wakes up the lwts whose operations completed in the io_uring of the
+ current kernel thread
+ */
+void __lwt_io_reap()
+{
+	struct __lwt_kthd_t__* kthd = __current_kthd;
+	void* data;
+	int res;
+
+	while (uring_reap(kthd->uring, &data, &res))
+	{
+		struct __lwt_io_t__* io = data;
+		io->res = res;
+		io->done = 1;
+		kthd->io_num--;
+		__lwt_wakeup(io->lwt);
+	}
+}
+
+ssize_t lwt_pread(int fd, void* buf, size_t count, off_t offset)
+{
+	struct __lwt_io_t__ io = { IORING_OP_READ, fd, buf, count, offset, NULL, 0, 0 };
+	return __lwt_io(&io);
+}
+
+ssize_t lwt_pwrite(int fd, const void* buf, size_t count, off_t offset)
+{
+	struct __lwt_io_t__ io = { IORING_OP_WRITE, fd, (void*)buf, count, offset, NULL, 0, 0 };
+	return __lwt_io(&io);
+}
+
+int lwt_fsync(int fd)
+{
+	struct __lwt_io_t__ io = { IORING_OP_FSYNC, fd, NULL, 0, 0, NULL, 0, 0 };
+	return __lwt_io(&io);
+}
+
+// =======================================================
+
+void* __lwt_kthd_entry(void* param)
+{
+	struct __lwt_kthd_entry_param_t__* p = param;
+
+	__current_kthd = p->kthd;
+	__lwt_main_thread_init();
+	__idle_thread = __lwt_current_inline();
+	
+	debug_print("%p: creating lwt.....", lwt_current());
+	__lwt_create_init_existing(p->lwt, LWT_F_NOJOIN, p->fn, p->data, p->c);
+	debug_print("%p: new lwt %p created.\n", lwt_current(), p->lwt);
+
+	free(param);
+	
+	__lwt_kthd_idle();
+
+	return NULL;
+}
+
+void __lwt_kthd_idle()
+{
+//	debug_print("%p: __lwt_kthd_idle in pthread %p. \n", lwt_current(), pthread_self());
+	int spin = 0;
+	while(1)
+	{
+		__lwt_kthd_drain();
+		if (__current_kthd->run_deque)
+			__lwt_pool_schedule();
+		if (__atomic_load_n(&__current_kthd->remote_free, __ATOMIC_RELAXED))
+			__lwt_slab_drain_remote();
+		if (__current_kthd->poll_num)
+		{
+			struct timespec zero = { 0, 0 };
+			__lwt_netpoll(&zero);
+		}
+		// one submission for the operations queued during the last round
+		if (__current_kthd->uring && uring_queued(__current_kthd->uring))
+			uring_submit(__current_kthd->uring);
+		// on behalf of lwt_offload()
+		if (__current_kthd->helpers_wanted)
+		{
+			__current_kthd->helpers_wanted = 0;
+			pthread_once(&__lwt_helpers_once, __lwt_helpers_init);
+		}
+
+		// nothing but the idle thread is runnable: spin for a short
+		// while, then sleep until another kernel thread posts a wakeup
+		if (lwt_queue_size(&__run_q) == 1)
+		{
+			if (++spin >= LWT_KTHD_PARK_SPIN)
+			{
+				spin = 0;
+				__lwt_kthd_park();
+			}
+			else
+				__builtin_ia32_pause();
+		}
+		else
+			spin = 0;
+
+		lwt_yield(LWT_NULL);
+	}
+}
+
+int lwt_kthd_create(lwt_fn_t fn, void* data, lwt_chan_t c)
+{
+	pthread_attr_t attr;
+	if (0 != pthread_attr_init(&attr))
+		return -1;
+
+	// whatever is set up below is undone at the end, unless the kernel
+	// thread is started
+	int started = 0;
+	struct __lwt_kthd_t__* kthd = NULL;
+	struct __lwt_kthd_entry_param_t__* param = malloc(sizeof(struct __lwt_kthd_entry_param_t__));
+	if (param)
+		kthd = malloc(sizeof(struct __lwt_kthd_t__));
+	if (kthd)
+	{
+		param->kthd = kthd;
+		param->lwt = NULL;
+		if (0 == __lwt_kthd_init(kthd)
+			&& 0 == pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+			param->lwt = __lwt_tcb_alloc(__lwt_stack_class(DEFAULT_LWT_STACK_SIZE));
+	}
+
+	if (kthd && param->lwt)
+	{
+		lwt_t cur_lwt = __lwt_current_inline();
+		int was_sndr = 0;
+
+		param->fn = fn;
+		param->data = data;
+		param->c = c;
+
+		if (c)
+		{
+			__lwt_chan_lock(c);
+			was_sndr = ptr_set_contains(c->s_list, cur_lwt);
+			__lwt_chan_add_sndr(c, cur_lwt);
+			c->receiver = param->lwt;
+			__lwt_chan_unlock(c);
+		}
+
+		debug_print("%p: create pthread. Current pthread: %p\n", lwt_current(), pthread_self());
+		started = 0 == pthread_create(&kthd->pthread_id, &attr, &__lwt_kthd_entry, param);
+		if (!started)
+		{
+			// the TCB is recycled: it must not be left as the receiver of c
+			if (c)
+			{
+				__lwt_chan_lock(c);
+				c->receiver = NULL;
+				if (!was_sndr)
+				{
+					ptr_set_remove(c->s_list, cur_lwt);
+					if (cur_lwt->snd_serial == c->serial)
+						cur_lwt->snd_serial = 0;
+				}
+				__lwt_chan_unlock(c);
+			}
+			__lwt_tcb_free(param->lwt);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	if (started)
+		return 0;
+
+	if (kthd)
+	{
+		__lwt_kthd_fini(kthd);
+		free(kthd);
+	}
+	free(param);
+	return -1;
+}
+
+/**
+ Entry of the kernel threads started by lwt_kthd_pool()
+ */
+void* __lwt_pool_worker_entry(void* param)
+{
+	struct __lwt_pool_t__* pool = __lwt_pool;
+	int state;
+	while (!(state = __atomic_load_n(&pool->state, __ATOMIC_ACQUIRE)))
+		syscall(SYS_futex, &pool->state, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+	if (state < 0)
+	{
+		// our kthd is freed by lwt_kthd_pool() once every worker is gone
+		if (__atomic_sub_fetch(&pool->started_num, 1, __ATOMIC_RELEASE) == 0)
+			syscall(SYS_futex, &pool->started_num, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+		return NULL;
+	}
+
+	__current_kthd = param;
+	__lwt_main_thread_init();
+	__idle_thread = __lwt_current_inline();
+	__lwt_set_name(__idle_thread, "idle");
+
+	__lwt_kthd_idle();
+
+	return NULL;
+}
+
+int lwt_kthd_pool(size_t n)
+{
+	if (n == 0 || __lwt_pool)
+		return -1;
+
+	struct __lwt_pool_t__* pool = malloc(sizeof(struct __lwt_pool_t__) + n * sizeof(struct __lwt_kthd_t__*));
+	if (!pool)
+		return -1;
+	pool->parked_num = 0;
+	pool->state = 0;
+	pool->started_num = 0;
+	pool->size = n;
+	memset(pool->workers, 0, n * sizeof(struct __lwt_kthd_t__*));
+
+	// every worker and deque exists before any worker can steal.
+	// The calling kernel thread is worker 0
+	size_t i;
+	for (i = 0; i < n; i++)
+	{
+		struct __lwt_kthd_t__* kthd = __current_kthd;
+		if (i > 0)
+		{
+			kthd = malloc(sizeof(struct __lwt_kthd_t__));
+			if (!kthd)
+				return __lwt_pool_free(pool);
+		}
+		// recorded first, so that __lwt_pool_free() also frees a worker
+		// whose __lwt_kthd_init() failed
+		pool->workers[i] = kthd;
+		if (i > 0 && 0 != __lwt_kthd_init(kthd))
+			return __lwt_pool_free(pool);
+
+		kthd->run_deque = ws_deque_init(LWT_POOL_DEQUE_SIZE);
+		if (!kthd->run_deque)
+			return __lwt_pool_free(pool);
+		kthd->steal_next = i + 1;
+	}
+	__lwt_pool = pool;
+
+	// the workers wait for pool->state, so that a failure here can
+	// still take them all down
+	pthread_attr_t attr;
+	if (0 != pthread_attr_init(&attr))
+		return __lwt_pool_free(pool);
+
+	int state = 1;
+	if (0 != pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+		state = -1;
+	for (i = 1; i < n && state > 0; i++)
+	{
+		if (0 != pthread_create(&pool->workers[i]->pthread_id, &attr, &__lwt_pool_worker_entry, pool->workers[i]))
+			state = -1;
+		else
+			__atomic_fetch_add(&pool->started_num, 1, __ATOMIC_RELAXED);
+	}
+	pthread_attr_destroy(&attr);
+
+	__atomic_store_n(&pool->state, state, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &pool->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	if (state > 0)
+		return 0;
+
+	int started;
+	while ((started = __atomic_load_n(&pool->started_num, __ATOMIC_ACQUIRE)))
+		syscall(SYS_futex, &pool->started_num, FUTEX_WAIT_PRIVATE, started, NULL, NULL, 0);
+	return __lwt_pool_free(pool);
+}
+
+/**
+ Undoes a failed lwt_kthd_pool(): frees the deques and the kthds of the
+ workers, none of which runs, and leaves the caller out of any pool.
+ Returns -1
+ */
+int __lwt_pool_free(struct __lwt_pool_t__* pool)
+{
+	size_t i;
+	for (i = 0; i < pool->size && pool->workers[i]; i++)
+	{
+		struct __lwt_kthd_t__* kthd = pool->workers[i];
+		if (kthd->run_deque)
+			ws_deque_free(&kthd->run_deque);
+		if (i > 0)
+		{
+			__lwt_kthd_fini(kthd);
+			free(kthd);
+		}
+	}
+	__lwt_pool = NULL;
+	free(pool);
+	return -1;
+}
+
+/**
+ Creates a lwt thread, with the entry function pointer fn,
+ and the parameter pointer data used by fn
+ Returns lwt_t type
+ */
+lwt_t lwt_create(lwt_fn_t fn, void* data, lwt_flags_t flags, lwt_chan_t c)
+{
+	lwt_attr_t attr;
+	lwt_attr_init(&attr);
+	attr.flags = flags;
+	attr.chan = c;
+
+	return lwt_create_attr(fn, data, &attr);
+}
+
+void lwt_attr_init(lwt_attr_t* attr)
+{
+	if (!attr)
+		return;
+
+	attr->stack_size = DEFAULT_LWT_STACK_SIZE;
+	attr->flags = LWT_F_NONE;
+	attr->chan = NULL;
+	attr->name = NULL;
+	attr->kthd = NULL;
+}
+
+lwt_t lwt_create_attr(lwt_fn_t fn, void* data, const lwt_attr_t* attr)
+{
+	lwt_attr_t default_attr;
+	if (!attr)
+	{
+		lwt_attr_init(&default_attr);
+		attr = &default_attr;
+	}
+
+	int cls = __lwt_stack_class(attr->stack_size ? attr->stack_size : DEFAULT_LWT_STACK_SIZE);
+	if (cls < 0)
+		return LWT_NULL;
+
+	lwt_t new_lwt = __lwt_tcb_alloc(cls);
+	if (!new_lwt)
+		return LWT_NULL;
+		
+	lwt_chan_t c = attr->chan;
 	new_lwt->id = __lwt_get_next_threadid();
 	new_lwt->status = LWT_S_READY;
 	new_lwt->entry_fn = fn;
 	new_lwt->entry_fn_param = data;
-	new_lwt->flags = flags;
+	new_lwt->flags = attr->flags;
 	new_lwt->joiner = NULL;
-	new_lwt->kthd = __current_kthd;
+	new_lwt->snd_serial = 0;
+	new_lwt->kthd = attr->kthd ? attr->kthd : __current_kthd;
+	__lwt_set_name(new_lwt, attr->name);
 	
 	__lwt_create_init_stack(new_lwt, fn, data, c);
-	
-	lwt_queue_inqueue(&__run_q, new_lwt);
 
 	if (c)
 	{
+		__lwt_chan_lock(c);
 		c->receiver = new_lwt;
+		__lwt_chan_unlock(c);
 		debug_print("%p: channel \"%s\" was delegated to %p\n", lwt_current(), lwt_chan_get_name(c), new_lwt);
 	}
 	
+	if (new_lwt->kthd == __current_kthd)
+	{
+		// on a pool worker, a thread not bound to a kernel thread
+		// goes to our deque, where idle workers can steal it
+		if (attr->kthd || !__current_kthd->run_deque || 0 != __lwt_pool_push(new_lwt))
+			lwt_queue_inqueue(&__run_q, new_lwt);
+	}
+	else
+	{
+		// hand it over to the other kernel thread
+		new_lwt->status = LWT_S_CREATED;
+		__lwt_kthd_wakeup(new_lwt->kthd, new_lwt);
+	}
+	
 	return new_lwt;
 }
 
@@ -941,12 +2926,24 @@ void lwt_yield(lwt_t target)
 {
 	lwt_t current_lwt = lwt_queue_head_next(&__run_q);
 	current_lwt->status = LWT_S_READY;
+	__lwt_kthd_drain();
+
+	// a thread not started yet in a work-stealing deque runs once it is taken
+	if (target && __lwt_is_stealable(target))
+		target = LWT_NULL;
+
+	// a thread on another kernel thread cannot be switched to: wake it up instead
+	if (target && target->kthd != __current_kthd)
+	{
+		__lwt_kthd_wakeup(target->kthd, target);
+		target = LWT_NULL;
+	}
 
 	if (target)
 	{
 		if (target->status == LWT_S_BLOCKED)
 		{
-			lwt_queue_remove(&__wait_q, target);
+			__current_kthd->blocked_num--;
 			lwt_queue_insert_before(&__run_q, lwt_queue_peek(&__run_q), target);
 		}
 		else if (target->status == LWT_S_READY)
@@ -962,6 +2959,23 @@ void lwt_yield(lwt_t target)
 	__lwt_dispatch(next_lwt, current_lwt);
 }
 
+lwt_time_t lwt_now()
+{
+	return __lwt_now();
+}
+
+void lwt_sleep(lwt_time_t ns)
+{
+	lwt_sleep_until(__lwt_deadline(ns));
+}
+
+void lwt_sleep_until(lwt_time_t deadline)
+{
+	// woken up early only by a stray wakeup: sleep again
+	while (__lwt_block_until(deadline) == 0)
+		;
+}
+
 /**
  Joins a specified thread and waits for its termination.
  The pointer to the returned value will be passed via retval_ptr
@@ -983,28 +2997,41 @@ int lwt_join(lwt_t lwt, void** retval_ptr)
 	if (__lwt_flags_get_nojoin(lwt))
 		return -4;
 
-	if (lwt->joiner)
+	// Register as the joiner, unless lwt has already died (see __lwt_die_finalize)
+	lwt_t joiner = NULL;
+	if (__atomic_compare_exchange_n(&lwt->joiner, &joiner, cur_lwt, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		// Block until the joining thread finishes.
+		// Thread is joinable
+		while(__atomic_load_n(&lwt->status, __ATOMIC_ACQUIRE) < LWT_S_FINISHED)	// LWT_S_DEAD > LWT_S_FINISHED
+			__lwt_block();
+	}
+	else if (joiner == LWT_JOINER_ZOMBIE)
+	{
+		// __lwt_die_finalize() may still be storing the status on another
+		// kernel thread; that store is its last access to the TCB
+		int spin = 0;
+		while (__atomic_load_n(&lwt->status, __ATOMIC_ACQUIRE) != LWT_S_ZOMBIE)
+		{
+			if (++spin >= LWT_KTHD_IDLE_SPIN)
+			{
+				spin = 0;
+				sched_yield();
+			}
+			else
+				__builtin_ia32_pause();
+		}
+		__atomic_fetch_sub(&lwt->kthd->zombie_num, 1, __ATOMIC_RELAXED);
+	}
+	else
 		return -5;
 	
-	lwt->joiner = cur_lwt;
-
-	// Block until the joining thread finishes.
-	// Thread is joinable
-	while(lwt->status < LWT_S_FINISHED)	// LWT_S_DEAD > LWT_S_FINISHED
-		__lwt_block();
-	
 	if (retval_ptr)
 	{
 		*retval_ptr = lwt->return_val;
 	}
 
-	if (lwt->status == LWT_S_ZOMBIE)
-	{
-		lwt_queue_remove(&__zombie_q, lwt);
-	}
-
-	lwt->status = LWT_S_DEAD;
-	lwt_queue_inqueue(&__dead_q, lwt);
+	__lwt_tcb_free(lwt);
 
 	return 0;
 }
@@ -1016,38 +3043,61 @@ int lwt_join(lwt_t lwt, void** retval_ptr)
 void lwt_die(void* data)
 {
 	lwt_t lwt_finished = lwt_queue_dequeue(&__run_q);
-	lwt_finished->status = LWT_S_FINISHED;
 	lwt_finished->return_val = data;
+	__lwt_kthd_drain();
 
-	if (!lwt_finished->joiner)
-	{
-		if (__lwt_flags_get_nojoin(lwt_finished))
-		{
-			lwt_finished->status = LWT_S_DEAD;
-			lwt_queue_inqueue(&__dead_q, lwt_finished);
-		}
-		else
-		{
-			lwt_queue_inqueue(&__zombie_q, lwt_finished);
-			lwt_finished->status = LWT_S_ZOMBIE;
-		}
-	}
-	else
-	{
-		__lwt_wakeup(lwt_finished->joiner);
-	}
+	// The joiner may run on another kernel thread and recycle this TCB
+	// as soon as it sees the thread finished, so that is only published
+	// once we are off this stack: see __lwt_reap_dying()
+	__dying_lwt = lwt_finished;
 	
+	// never empty: the idle thread does not block, it parks the kernel
+	// thread when nothing else is runnable
 	lwt_t next_lwt = lwt_queue_peek(&__run_q);
-	// ??? is wakeup_all a good solution to avoid an empty run queue ???
-	if (!next_lwt)
-		__lwt_wakeup_all();
-
-	next_lwt = lwt_queue_peek(&__run_q);
 	assert(next_lwt);
 	next_lwt->status = LWT_S_RUNNING;
 	__lwt_dispatch(next_lwt, lwt_finished);
 }
 
+/**
+ Finalizes the thread that called lwt_die(), if any.
+ Called by every thread right after it is switched to.
+ */
+void __lwt_reap_dying()
+{
+	if (__dying_lwt)
+	{
+		lwt_t lwt = __dying_lwt;
+		__dying_lwt = NULL;
+		__lwt_die_finalize(lwt);
+	}
+}
+
+void __lwt_die_finalize(lwt_t lwt)
+{
+	if (__lwt_flags_get_nojoin(lwt))
+	{
+		__lwt_tcb_free(lwt);
+		return;
+	}
+
+	// once the status is stored, a joiner may free the TCB at any time
+	struct __lwt_kthd_t__* kthd = lwt->kthd;
+	lwt_t joiner = NULL;
+	if (__atomic_compare_exchange_n(&lwt->joiner, &joiner, LWT_JOINER_ZOMBIE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		// nobody has joined yet.
+		// A remote joiner may decrement zombie_num before this increment lands.
+		__atomic_fetch_add(&kthd->zombie_num, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&lwt->status, LWT_S_ZOMBIE, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		__atomic_store_n(&lwt->status, LWT_S_FINISHED, __ATOMIC_RELEASE);
+		__lwt_wakeup(joiner);
+	}
+}
+
 /**
  Gets the current thread lwt_t
  */
@@ -1074,16 +3124,48 @@ int lwt_id(lwt_t lwt)
 	return lwt->id;
 }
 
+const char* lwt_name(lwt_t lwt)
+{
+	if (!lwt)
+		return NULL;
+	
+	return lwt->name;
+}
+
+lwt_kthd_t* lwt_kthd_current()
+{
+	return __current_kthd;
+}
+
+void lwt_slab_hwm_set(size_t bytes)
+{
+	__atomic_store_n(&__lwt_slab_hwm, bytes, __ATOMIC_RELAXED);
+}
+
+size_t lwt_slab_hwm_get()
+{
+	return __atomic_load_n(&__lwt_slab_hwm, __ATOMIC_RELAXED);
+}
+
 size_t lwt_info(lwt_info_type_t type)
 {
 	switch (type) {
 		case LWT_INFO_NTHD_RUNNABLE:
 			return lwt_queue_size(&__run_q);
 		case LWT_INFO_NTHD_BLOCKED:
-			return lwt_queue_size(&__wait_q);
+			return __current_kthd->blocked_num;
+		case LWT_INFO_NBYTES_SLAB:
+			return __current_kthd->slab_bytes;
+		case LWT_INFO_NBYTES_FREE:
+			return __current_kthd->free_bytes;
+		case LWT_INFO_NPARKS:
+			return __current_kthd->park_num;
 		case LWT_INFO_NTHD_ZOMBIES:
 		default:
-			return lwt_queue_size(&__zombie_q);
+		{
+			long n = __atomic_load_n(&__current_kthd->zombie_num, __ATOMIC_RELAXED);
+			return n > 0 ? n : 0;
+		}
 	}
 }
 
@@ -1091,6 +3173,54 @@ size_t lwt_info(lwt_info_type_t type)
 // lwt channel
 // ===================================================================
 
+void __lwt_spin_lock(int* lock)
+{
+	int spin = 0;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+	{
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+		{
+			// the holder may have been preempted
+			if (++spin >= LWT_KTHD_IDLE_SPIN)
+			{
+				spin = 0;
+				sched_yield();
+			}
+			else
+				__builtin_ia32_pause();
+		}
+	}
+}
+
+void __lwt_spin_unlock(int* lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+void __lwt_chan_lock(lwt_chan_t c)
+{
+	__lwt_spin_lock(&c->lock);
+}
+
+void __lwt_chan_unlock(lwt_chan_t c)
+{
+	__lwt_spin_unlock(&c->lock);
+}
+
+/**
+ Blocks the current thread with the lock of c released, until deadline
+ at most (see __lwt_block_until()).
+ Wakeups from other kernel threads are only processed by our own kernel
+ thread after we have switched out, so none can be lost in between.
+ */
+int __lwt_chan_block_until(lwt_chan_t c, lwt_time_t deadline)
+{
+	__lwt_chan_unlock(c);
+	int rc = __lwt_block_until(deadline);
+	__lwt_chan_lock(c);
+	return rc;
+}
+
 int __lwt_chan_use_buffer(lwt_chan_t c)
 {
 	return c->snd_buffer_size > 0;
@@ -1119,151 +3249,359 @@ void __lwt_chan_init_snd_buffer(lwt_chan_t c, size_t sz)
 		c->snd_buffer = NULL;
 	else
 	{
-		c->snd_buffer = ring_queue_init(sz);
+		c->snd_buffer = mpmc_queue_init(sz, c->elem_size);
 	}
 }
 
 void __lwt_chan_free_snd_buffer(lwt_chan_t c)
 {
 	if (c->snd_buffer)
-		ring_queue_free(&(c->snd_buffer));
+		mpmc_queue_free(&(c->snd_buffer));
+}
+
+int __lwt_chan_try_to_free(lwt_chan_t *c)
+{
+	if (!((*c)->receiver) && ptr_set_size((*c)->s_list) == 0)
+	{
+		__lwt_chan_free_snd_buffer(*c);
+		ptr_set_free(&((*c)->s_list));
+		free((*c)->name);
+		free(*c);
+		*c = NULL;
+		return 1;
+	}
+	else
+		return 0;
+}
+
+/**
+ Readies lwt, whose waiter has just been unlinked from a queue of c,
+ and releases the lock of c.
+ An lwt on this kernel thread is switched to right away; one on another
+ kernel thread is posted while the lock still keeps its waiter alive.
+ */
+void __lwt_chan_handoff(lwt_chan_t c, lwt_t lwt)
+{
+	if (lwt->kthd == __current_kthd)
+	{
+		__lwt_chan_unlock(c);
+		lwt_yield(lwt);
+	}
+	else
+	{
+		__lwt_kthd_wakeup(lwt->kthd, lwt);
+		__lwt_chan_unlock(c);
+	}
 }
 
-int __lwt_chan_try_to_free(lwt_chan_t *c)
+/**
+ Copies a message of c from src to dst
+ */
+void __lwt_chan_copy(lwt_chan_t c, void* dst, const void* src)
 {
-	if (!((*c)->receiver) && dlinkedlist_size((*c)->s_list) == 0)
-	{
-		__lwt_chan_free_snd_buffer(*c);
-		free((*c)->name);
-		free(*c);
-		*c = NULL;
-		return 1;
-	}
+	// the common case of a pointer, without a call to memcpy
+	if (c->elem_size == sizeof(void*))
+		*(void**)dst = *(void* const*)src;
 	else
-		return 0;
+		memcpy(dst, src, c->elem_size);
 }
 
-void __lwt_snd_blocked(lwt_t sndr, lwt_chan_t c, void* data)
+/**
+ Unbuffered send: copies val straight into the slot of a parked receiver,
+ or parks with val in its waiter until a receiver copies it out.
+ Returns 1 if no receiver took val before deadline; otherwise, 0
+ */
+int __lwt_snd_blocked(lwt_t sndr, lwt_chan_t c, const void* val, lwt_time_t deadline)
 {
 	debug_print("%p: lwt_snd: -> __lwt_snd_blocked.\n", lwt_current());
 	
-	// Add sndr to sender queue
-	dlinkedlist_add(c->s_queue, dlinkedlist_element_init(sndr));
-
-	// wait until my turn
-	while (dlinkedlist_first(c->s_queue)->data != sndr)
+	struct __lwt_waiter_t__* rw = c->r_queue.head;
+	if (rw)
 	{
-		debug_print("%p: __lwt_snd_blocked: wait until my turn.\n", lwt_current());
-		__lwt_block();
+		// the receiver returns as soon as it sees rw unlinked,
+		// so rw is not touched after that
+		lwt_t rcvr = rw->lwt;
+		__lwt_chan_copy(c, rw->data, val);
+		__lwt_wait_list_remove(&c->r_queue, rw);
+		debug_print("%p: __lwt_snd_blocked: hand off to rcver %p.\n", lwt_current(), rcvr);
+		__lwt_chan_handoff(c, rcvr);
+		return 0;
 	}
-
-	// now it is my turn, set the data
-	c->snd_data = data;
 	
-	// wait if it is my turn but no receiver exists or is blocked on this channel
-	while (!c->rcv_blocked && c->snd_data)
+	if (deadline == LWT_DEADLINE_NOW)
 	{
-		debug_print("%p: __lwt_snd_blocked: spinning no rcv.\n", lwt_current());
-		__lwt_block();
+		__lwt_chan_unlock(c);
+		return 1;
 	}
 	
-	// Now the receiver is ready to receive, yield to it
-	debug_print("%p: __lwt_snd_blocked: yield to rcver %p.\n", lwt_current(), c->receiver);
-	lwt_yield(c->receiver);
+	// no receiver yet: w lives on our stack, the receiver unlinks it
+	// when it has copied val
+	struct __lwt_waiter_t__ w = { sndr, NULL, NULL, 0, (void*)val };
+	__lwt_wait_list_add(&c->s_queue, &w);
+	while (w.queued)
+	{
+		debug_print("%p: __lwt_snd_blocked: waiting for a rcver.\n", lwt_current());
+		if (__lwt_chan_block_until(c, deadline) && w.queued)
+		{
+			__lwt_wait_list_remove(&c->s_queue, &w);
+			__lwt_chan_unlock(c);
+			return 1;
+		}
+	}
+	__lwt_chan_unlock(c);
+	return 0;
 }
 
-void* __lwt_rcv_blocked(lwt_chan_t c)
+/**
+ Unbuffered receive: copies the value of the first parked sender into
+ val, or parks until a sender copies its value there.
+ Returns 1 if no sender came before deadline; otherwise, 0
+ */
+int __lwt_rcv_blocked(lwt_chan_t c, void* val, lwt_time_t deadline)
 {
-	debug_print("%p: __lwt_rcv_blocked: spinning nobody snd\n", lwt_current());
-	// spinning if nobody is sending on this channel
-	while (dlinkedlist_size(c->s_queue) == 0)
+	struct __lwt_waiter_t__* sw = c->s_queue.head;
+	if (sw)
 	{
-		c->rcv_blocked = 1;
-		__lwt_block();
+		lwt_t sndr = sw->lwt;
+		__lwt_chan_copy(c, val, sw->data);
+		__lwt_wait_list_remove(&c->s_queue, sw);
+		debug_print("%p: __lwt_rcv_blocked: rcved from %p.\n", lwt_current(), sndr);
+		
+		// the sender is only readied: we go on with the data
+		__lwt_wakeup(sndr);
+		__lwt_chan_unlock(c);
+		return 0;
 	}
 	
-	debug_print("%p: __lwt_rcv_blocked: rcved %p.\n", lwt_current(), c->snd_data);
-	// now the data has been sent via the channel, get it, and set receiver's status to non-blocked
-	void *data = c->snd_data;
-	c->snd_data = NULL;
-	c->rcv_blocked = 0;
+	if (deadline == LWT_DEADLINE_NOW)
+	{
+		__lwt_chan_unlock(c);
+		return 1;
+	}
 	
-	// remove sender from the sender queue
-	dlinkedlist_element_t* e = dlinkedlist_first(c->s_queue);
-	dlinkedlist_remove(c->s_queue, e);
-	lwt_t sndr = e->data;
-	__lwt_wakeup(sndr);
-	dlinkedlist_element_free(&e);
+	debug_print("%p: __lwt_rcv_blocked: waiting for a sndr.\n", lwt_current());
+	struct __lwt_waiter_t__ w = { __lwt_current_inline(), NULL, NULL, 0, val };
+	__lwt_wait_list_add(&c->r_queue, &w);
+	while (w.queued)
+	{
+		if (__lwt_chan_block_until(c, deadline) && w.queued)
+		{
+			__lwt_wait_list_remove(&c->r_queue, &w);
+			__lwt_chan_unlock(c);
+			return 1;
+		}
+	}
+	__lwt_chan_unlock(c);
+	return 0;
+}
+
+/**
+ Links w into list, with the lock of c held, before a last check of the
+ buffer. Pairs with the fence in __lwt_chan_wake(): either the waker
+ sees us parked, or our check sees the update it made to the buffer.
+ */
+void __lwt_chan_park(struct __lwt_wait_list_t__* list, int* parked, struct __lwt_waiter_t__* w)
+{
+	__lwt_wait_list_add(list, w);
+	__atomic_fetch_add(parked, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
-	return data;
+/**
+ Unlinks w, still in list, with the lock of c held
+ */
+void __lwt_chan_unpark(struct __lwt_wait_list_t__* list, int* parked, struct __lwt_waiter_t__* w)
+{
+	__lwt_wait_list_remove(list, w);
+	__atomic_fetch_sub(parked, 1, __ATOMIC_RELAXED);
 }
 
-void __lwt_snd_buffered(lwt_t sndr, lwt_chan_t c, void* data)
+/**
+ Wakes up to n lwts parked in list, after the buffer of c was updated.
+ Only takes the lock of c when someone is parked.
+ */
+void __lwt_chan_wake(lwt_chan_t c, struct __lwt_wait_list_t__* list, int* parked, size_t n)
 {
-	while (ring_queue_full(c->snd_buffer))
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(parked, __ATOMIC_RELAXED))
+		return;
+
+	__lwt_chan_lock(c);
+	lwt_t lwt;
+	while (n-- > 0 && (lwt = __lwt_wait_list_pop(list)))
 	{
-		debug_print("%p: __lwt_snd_buffered: wait until buffer has space.\n", sndr);
-		
-		// insert into blocking queue
-		// (c->s_queue is here used as a queue storing threads blocking on __lwt_snd_buffered)
-		dlinkedlist_add(c->s_queue, dlinkedlist_element_init(sndr));
-		
-		debug_print("%p: __lwt_snd_buffered: call __lwt_block_and_wakeup %p\n", sndr, c->receiver);
-		__lwt_block_and_wakeup(c->receiver);
-		debug_print("%p: __lwt_snd_buffered: after calling __lwt_block_and_wakeup\n", sndr);
+		__atomic_fetch_sub(parked, 1, __ATOMIC_RELAXED);
+		debug_print("%p: __lwt_chan_wake: wake up %p\n", lwt_current(), lwt);
+		__lwt_wakeup(lwt);
 	}
-	
-	// remove from the block queue
-	dlinkedlist_element_t* e = dlinkedlist_find(c->s_queue, sndr);
-	dlinkedlist_remove(c->s_queue, e);
-	dlinkedlist_element_free(&e);
-	
-	debug_print("%p: __lwt_snd_buffered: buffer inqueue data %p\n", lwt_current(), data);
-	ring_queue_inqueue(c->snd_buffer, data);
-	__lwt_wakeup(c->receiver);
+	__lwt_chan_unlock(c);
 }
 
-void* __lwt_rcv_buffered(lwt_chan_t c)
+/**
+ Pushes items into the buffer, parking while it is full, until deadline.
+ A parked receiver is woken up once, after the last push.
+ Returns the number of items pushed
+ */
+size_t __lwt_snd_buffered_many(lwt_t sndr, lwt_chan_t c, const void* items, size_t n, lwt_time_t deadline)
 {
-	// spinning if buffer is empty
-	while (ring_queue_empty(c->snd_buffer))
+	size_t sent = mpmc_queue_push_many(c->snd_buffer, items, n);
+	if (sent < n && deadline != LWT_DEADLINE_NOW)
 	{
-		debug_print("%p: __lwt_rcv_buffered: blocking buffer empty\n", lwt_current());
-		__lwt_block();
+		struct __lwt_waiter_t__ w = { sndr, NULL, NULL, 0, NULL };
+		int timed_out = 0;
+		__lwt_chan_lock(c);
+		while (1)
+		{
+			// once timed out, only a last push: a wakeup that came
+			// along is not lost, whoever filled the slot used it
+			if (!w.queued && !timed_out)
+				__lwt_chan_park(&c->s_queue, &c->s_parked, &w);
+			if ((sent += mpmc_queue_push_many(c->snd_buffer, (const char*)items + sent * c->elem_size, n - sent)) == n
+				|| timed_out)
+				break;
+
+			debug_print("%p: __lwt_snd_buffered_many: wait until buffer has space.\n", sndr);
+			timed_out = __lwt_chan_block_until(c, deadline);
+		}
+		
+		// w lives on our stack
+		if (w.queued)
+			__lwt_chan_unpark(&c->s_queue, &c->s_parked, &w);
+		__lwt_chan_unlock(c);
 	}
 	
-	void* data = ring_queue_dequeue(c->snd_buffer);
-	debug_print("%p: __lwt_rcv_buffered: buffer having data %p\n", lwt_current(), data);
+	debug_print("%p: __lwt_snd_buffered_many: buffer inqueued %zu items\n", lwt_current(), sent);
+	if (sent > 0)
+		__lwt_chan_wake(c, &c->r_queue, &c->r_parked, 1);
+	return sent;
+}
 
-	dlinkedlist_element_t* e = dlinkedlist_first(c->s_queue);
-	if (e)
+/**
+ Pops up to max items out of the buffer, parking while it is empty,
+ until deadline. Wakes up one parked sender for every slot freed.
+ Returns the number of items popped
+ */
+size_t __lwt_rcv_buffered_many(lwt_chan_t c, void* out, size_t max, lwt_time_t deadline)
+{
+	size_t n = mpmc_queue_pop_many(c->snd_buffer, out, max);
+	if (n == 0 && deadline != LWT_DEADLINE_NOW)
 	{
-		dlinkedlist_remove(c->s_queue, e);
-		lwt_t sndr = e->data;
-		debug_print("%p: __lwt_rcv_buffered: wake up %p\n", lwt_current(), sndr);
-		__lwt_wakeup(sndr);
-		dlinkedlist_element_free(&e);
-	}
+		struct __lwt_waiter_t__ w = { __lwt_current_inline(), NULL, NULL, 0, NULL };
+		int timed_out = 0;
+		__lwt_chan_lock(c);
+		while (1)
+		{
+			if (!w.queued && !timed_out)
+				__lwt_chan_park(&c->r_queue, &c->r_parked, &w);
+			if ((n = mpmc_queue_pop_many(c->snd_buffer, out, max)) > 0 || timed_out)
+				break;
 
-	return data;
+			debug_print("%p: __lwt_rcv_buffered_many: blocking buffer empty\n", lwt_current());
+			timed_out = __lwt_chan_block_until(c, deadline);
+		}
+		
+		// w lives on our stack
+		if (w.queued)
+			__lwt_chan_unpark(&c->r_queue, &c->r_parked, &w);
+		__lwt_chan_unlock(c);
+	}
+	
+	debug_print("%p: __lwt_rcv_buffered_many: dequeued %zu items\n", lwt_current(), n);
+	if (n > 0)
+		__lwt_chan_wake(c, &c->s_queue, &c->s_parked, n);
+	return n;
 }
 
 void __lwt_chan_add_sndr(lwt_chan_t c, lwt_t sndr)
 {
-	if (!dlinkedlist_find(c->s_list, sndr))
-		dlinkedlist_add(c->s_list, dlinkedlist_element_init(sndr));
+	// a sender that is already known skips the registry
+	if (sndr->snd_serial == c->serial)
+		return;
+
+	ptr_set_add(c->s_list, sndr);
+	sndr->snd_serial = c->serial;
+}
+
+
+/**
+ Records a snd (dir 0) or rcv (dir 1) event on the group c belongs to,
+ if any: c is linked into the group's ready list unless it is already
+ there, and only then the waiter of the group, if any, is woken up
+ */
+void __lwt_chan_event(lwt_chan_t c, int dir)
+{
+	struct __lwt_cgrp_t__* grp = c->grp[dir];
+	if (!grp)
+		return;
+
+	__lwt_spin_lock(&grp->lock);
+	if (!c->event_queued[dir])
+	{
+		c->event_queued[dir] = 1;
+		c->ready_next[dir] = NULL;
+		if (grp->ready_tail[dir])
+			grp->ready_tail[dir]->ready_next[dir] = c;
+		else
+			grp->ready_head[dir] = c;
+		grp->ready_tail[dir] = c;
+		c->events_num[dir]++;
+		grp->total_num_events++;
+
+		lwt_t lwt = grp->waiter[dir];
+		if (lwt)
+		{
+			debug_print("%p: wake up event-waiting lwt %p.\n", lwt_current(), lwt);
+			grp->waiter[dir] = NULL;
+			__lwt_wakeup(lwt);
+		}
+	}
+	__lwt_spin_unlock(&grp->lock);
 }
 
+/**
+ Registers sndr as a sender of c and records the snd event.
+ The lock is only taken when there is something to record.
+ Returns -1 if sndr is the receiver of c; otherwise, 0
+ */
+int __lwt_chan_snd_begin(lwt_chan_t c, lwt_t sndr)
+{
+	// Forbit receiver from sending to itself
+	if (c->receiver == sndr)
+		return -1;
+
+	// If sndr has not sent on this channel before, add it to sender list.
+	// If the channel is added to a group that waits for snd event to happen,
+	// add the event.
+	if (sndr->snd_serial != c->serial || __atomic_load_n(&c->grp[0], __ATOMIC_RELAXED))
+	{
+		__lwt_chan_lock(c);
+		__lwt_chan_add_sndr(c, sndr);
+		__lwt_chan_event(c, 0);
+		__lwt_chan_unlock(c);
+	}
+	return 0;
+}
 
 // =======================================================
 
 lwt_chan_t lwt_chan(size_t sz, const char* name)
 {
+	return lwt_chan_typed(sz, sizeof(void*), name);
+}
+
+lwt_chan_t lwt_chan_typed(size_t sz, size_t elem_size, const char* name)
+{
+	if (elem_size == 0)
+		return NULL;
+
 	lwt_chan_t chan = malloc(sizeof(struct __lwt_chan_t__));
-	chan->s_list = dlinkedlist_init();
-	chan->s_queue = dlinkedlist_init();
-	chan->snd_data = NULL;
-	chan->rcv_blocked = 0;
+	chan->elem_size = elem_size;
+	chan->s_list = ptr_set_init(0);
+	chan->serial = __atomic_add_fetch(&__lwt_chan_serial, 1, __ATOMIC_RELAXED);
+	__lwt_wait_list_init(&chan->s_queue);
+	__lwt_wait_list_init(&chan->r_queue);
+	chan->s_parked = 0;
+	chan->r_parked = 0;
 	chan->receiver = __lwt_current_inline();
 	chan->grp[0] = NULL;
 	chan->grp[1] = NULL;
@@ -1272,6 +3610,9 @@ lwt_chan_t lwt_chan(size_t sz, const char* name)
 	chan->events_num[1] = 0;
 	chan->event_queued[0] = 0;
 	chan->event_queued[1] = 0;
+	chan->ready_next[0] = NULL;
+	chan->ready_next[1] = NULL;
+	chan->lock = 0;
 
 	__lwt_chan_set_name(chan, name);
 	__lwt_chan_init_snd_buffer(chan, sz);
@@ -1285,16 +3626,21 @@ int lwt_chan_deref(lwt_chan_t* c)
 		return -1;
 	
 	lwt_t cur_lwt = __lwt_current_inline();
-	if ((*c)->receiver == cur_lwt)
-		(*c)->receiver = NULL;
+	lwt_chan_t chan = *c;
+	__lwt_chan_lock(chan);
+	if (chan->receiver == cur_lwt)
+		chan->receiver = NULL;
 	else
 	{
-		dlinkedlist_element_t *e = dlinkedlist_find((*c)->s_list, cur_lwt);
-		if (e)
-			dlinkedlist_remove((*c)->s_list, e);
+		ptr_set_remove(chan->s_list, cur_lwt);
+		if (cur_lwt->snd_serial == chan->serial)
+			cur_lwt->snd_serial = 0;
 	}
 	
-	return __lwt_chan_try_to_free(c);
+	int rc = __lwt_chan_try_to_free(c);
+	if (!rc)
+		__lwt_chan_unlock(chan);
+	return rc;
 }
 
 const char* lwt_chan_get_name(lwt_chan_t c)
@@ -1305,88 +3651,158 @@ const char* lwt_chan_get_name(lwt_chan_t c)
 	return c->name;
 }
 
-int lwt_snd(lwt_chan_t c, void* data)
+/**
+ Sends the value at val, blocking until deadline at most.
+ Returns -1 if the current thread is the receiver of c;
+ 1 if the deadline passed before val was sent; otherwise, 0
+ */
+int __lwt_snd_val(lwt_chan_t c, const void* val, lwt_time_t deadline)
 {
-	// Forbit receiver from sending to itself
 	lwt_t sndr = __lwt_current_inline();
-	if (c->receiver == sndr)
+	if (__lwt_chan_snd_begin(c, sndr))
 		return -1;
-	
-	// If sndr has not sent on this channel before, add it to sender list
-	__lwt_chan_add_sndr(c, sndr);
 
-	// debug_print("%p: lwt_snd: %s's lwt_list count=%d", lwt_current(), lwt_chan_get_name(c), dlinkedlist_size(c->s_list));
-	// debug_print(", sending count=%d\n", lwt_chan_sending_count(c));
-	
-	// if the channel is added to a group that waits for snd event to happen
-	if (c->grp[0] && !c->event_queued[0])
-	{
-		// add snd event to the snd event queue (id=0)
-		dlinkedlist_add(c->grp[0]->event_queue[0], dlinkedlist_element_init(c));
-		c->event_queued[0] = 1;
-		c->events_num[0]++;
-		c->grp[0]->total_num_events++;
+	if (__lwt_chan_use_buffer(c))
+		return __lwt_snd_buffered_many(sndr, c, val, 1, deadline) ? 0 : 1;
 
-		// wakeup all rcvrs that are waiting for snd event on this group
-		debug_print("%p: wake up snd-event waiting lwts.\n", lwt_current());
+	__lwt_chan_lock(c);
+	return __lwt_snd_blocked(sndr, c, val, deadline);
+}
 
-		dlinkedlist_element_t* e;
-		dlinkedlist_t* wq = c->grp[0]->wait_queue[0];
-		while(dlinkedlist_size(wq) > 0)
-		{
-			e = dlinkedlist_first(wq);
-			dlinkedlist_remove(wq, e);
-			__lwt_wakeup(e->data);
-			debug_print("%p: waking up lwt %p\n", lwt_current(), e->data);
-		}
+/**
+ Receives a value into val, blocking until deadline at most.
+ Returns 1 if the deadline passed before a value came; otherwise, 0
+ */
+int __lwt_rcv_val(lwt_chan_t c, void* val, lwt_time_t deadline)
+{
+	// if the channel is added to a group that waits for rcv event to happen
+	if (__atomic_load_n(&c->grp[1], __ATOMIC_RELAXED))
+	{
+		__lwt_chan_lock(c);
+		__lwt_chan_event(c, 1);
+		__lwt_chan_unlock(c);
 	}
-
+	
 	if (__lwt_chan_use_buffer(c))
+		return __lwt_rcv_buffered_many(c, val, 1, deadline) ? 0 : 1;
+
+	debug_print("%p: lwt_rcv: -> __lwt_rcv_blocked.\n", lwt_current());
+	__lwt_chan_lock(c);
+	return __lwt_rcv_blocked(c, val, deadline);
+}
+
+int lwt_snd(lwt_chan_t c, void* data)
+{
+	if (c->elem_size != sizeof(void*))
+		return -1;
+
+	return __lwt_snd_val(c, &data, LWT_DEADLINE_NEVER);
+}
+
+void* lwt_rcv(lwt_chan_t c)
+{
+	void* ret = NULL;
+	if (c->elem_size != sizeof(void*))
 	{
-		__lwt_snd_buffered(sndr, c, data);
+		debug_print("%p: lwt_rcv: \"%s\" is a typed channel, use lwt_rcv_val.\n", lwt_current(), lwt_chan_get_name(c));
+		assert(c->elem_size == sizeof(void*));
+		return NULL;
 	}
-	else
+
+	__lwt_rcv_val(c, &ret, LWT_DEADLINE_NEVER);
+	return ret;
+}
+
+int lwt_snd_val(lwt_chan_t c, const void* val)
+{
+	return __lwt_snd_val(c, val, LWT_DEADLINE_NEVER);
+}
+
+void lwt_rcv_val(lwt_chan_t c, void* val)
+{
+	__lwt_rcv_val(c, val, LWT_DEADLINE_NEVER);
+}
+
+int lwt_try_snd(lwt_chan_t c, void* data)
+{
+	if (c->elem_size != sizeof(void*))
+		return -1;
+
+	return __lwt_snd_val(c, &data, LWT_DEADLINE_NOW);
+}
+
+int lwt_snd_timed(lwt_chan_t c, void* data, lwt_time_t timeout)
+{
+	if (c->elem_size != sizeof(void*))
+		return -1;
+
+	return __lwt_snd_val(c, &data, __lwt_deadline(timeout));
+}
+
+int lwt_try_rcv(lwt_chan_t c, void** data)
+{
+	if (c->elem_size != sizeof(void*))
+		return -1;
+
+	return __lwt_rcv_val(c, data, LWT_DEADLINE_NOW);
+}
+
+int lwt_rcv_timed(lwt_chan_t c, void** data, lwt_time_t timeout)
+{
+	if (c->elem_size != sizeof(void*))
+		return -1;
+
+	return __lwt_rcv_val(c, data, __lwt_deadline(timeout));
+}
+
+/**
+ Sends n items in order. On a buffered channel, they are pushed in as
+ many at a time as fit, with one receiver wakeup per batch
+ */
+int lwt_snd_many(lwt_chan_t c, void** items, size_t n)
+{
+	size_t i;
+	if (c->elem_size != sizeof(void*))
+		return -1;
+
+	if (!__lwt_chan_use_buffer(c))
 	{
-		__lwt_snd_blocked(sndr, c, data);
+		for (i = 0; i < n; i++)
+			if (lwt_snd(c, items[i]))
+				return -1;
+		return 0;
 	}
+
+	lwt_t sndr = __lwt_current_inline();
+	if (__lwt_chan_snd_begin(c, sndr))
+		return -1;
+
+	__lwt_snd_buffered_many(sndr, c, items, n, LWT_DEADLINE_NEVER);
 	return 0;
 }
 
-void* lwt_rcv(lwt_chan_t c)
+/**
+ Receives at least one and up to max items, all that a buffered
+ channel holds at the time; an unbuffered channel yields exactly one
+ */
+size_t lwt_rcv_many(lwt_chan_t c, void** out, size_t max)
 {
-	void* ret = NULL;
-	
-	// if the channel is added to a group that waits for rcv event to happen
-	if (c->grp[1] && !c->event_queued[1])
-	{
-		// add rcv event to the rcv event queue (id=1)
-		dlinkedlist_add(c->grp[1]->event_queue[1], dlinkedlist_element_init(c));
-		c->event_queued[1] = 1;
-		c->events_num[1]++;
-		c->grp[1]->total_num_events++;
-
-		// wakeup all sndrs that are waiting for rcv event on this grp
-		dlinkedlist_element_t* e;
-		dlinkedlist_t* wq = c->grp[1]->wait_queue[1];
-		while(dlinkedlist_size(wq) > 0)
-		{
-			e = dlinkedlist_first(wq);
-			dlinkedlist_remove(wq, e);
-			__lwt_wakeup(e->data);
-		}
-	}
-	
-	if (__lwt_chan_use_buffer(c))
+	if (max == 0 || c->elem_size != sizeof(void*))
+		return 0;
+
+	if (!__lwt_chan_use_buffer(c))
 	{
-		ret = __lwt_rcv_buffered(c);
+		out[0] = lwt_rcv(c);
+		return 1;
 	}
-	else
+
+	if (__atomic_load_n(&c->grp[1], __ATOMIC_RELAXED))
 	{
-		debug_print("%p: lwt_rcv: -> __lwt_rcv_blocked.\n", lwt_current());
-		ret = __lwt_rcv_blocked(c);
+		__lwt_chan_lock(c);
+		__lwt_chan_event(c, 1);
+		__lwt_chan_unlock(c);
 	}
-	
-	return ret;
+	return __lwt_rcv_buffered_many(c, out, max, LWT_DEADLINE_NEVER);
 }
 
 int lwt_snd_chan(lwt_chan_t c, lwt_chan_t sc)
@@ -1397,7 +3813,9 @@ int lwt_snd_chan(lwt_chan_t c, lwt_chan_t sc)
 int lwt_snd_cdeleg(lwt_chan_t c, lwt_chan_t delegating)
 {
 	// add sender to the sender list of delegating channel
+	__lwt_chan_lock(delegating);
 	__lwt_chan_add_sndr(delegating, __lwt_current_inline());
+	__lwt_chan_unlock(delegating);
 
 	return lwt_snd(c, delegating);
 }
@@ -1412,7 +3830,9 @@ lwt_chan_t lwt_rcv_cdeleg(lwt_chan_t c)
 	lwt_chan_t delegating = lwt_rcv(c);
 
 	// change the receiver of the received channel to current thread
+	__lwt_chan_lock(delegating);
 	delegating->receiver = __lwt_current_inline();
+	__lwt_chan_unlock(delegating);
 	
 	return delegating;
 }
@@ -1438,23 +3858,24 @@ size_t lwt_chan_sending_count(lwt_chan_t c)
 	if (!c)
 		return 0;
 	
-	return dlinkedlist_size(c->s_list);
+	return ptr_set_size(c->s_list);
 }
 
 lwt_cgrp_t lwt_cgrp()
 {
 	lwt_cgrp_t grp = malloc(sizeof(struct __lwt_cgrp_t__));
-	grp->event_queue[0] = dlinkedlist_init();
-	grp->event_queue[1] = dlinkedlist_init();
-
-	grp->wait_queue[0] = dlinkedlist_init();
-	grp->wait_queue[1] = dlinkedlist_init();
-
-	grp->listeners[0] = dlinkedlist_init();
-	grp->listeners[1] = dlinkedlist_init();
+	int i;
+	for (i = 0; i < 2; i++)
+	{
+		grp->ready_head[i] = NULL;
+		grp->ready_tail[i] = NULL;
+		grp->waiter[i] = NULL;
+		grp->listener[i] = NULL;
+		grp->channel_num[i] = 0;
+	}
 
-	grp->channel_num = 0;
 	grp->total_num_events = 0;
+	grp->lock = 0;
 	return grp;
 }
 
@@ -1462,148 +3883,143 @@ int lwt_cgrp_free(lwt_cgrp_t* grp)
 {
 	if (grp && (*grp))
 	{
-		if ((*grp)->channel_num > 0)
+		if ((*grp)->channel_num[0] > 0 || (*grp)->channel_num[1] > 0)
 			return -1;
 
-		dlinkedlist_free(&((*grp)->event_queue[0]));
-		dlinkedlist_free(&((*grp)->event_queue[1]));
-		dlinkedlist_free(&((*grp)->wait_queue[0]));
-		dlinkedlist_free(&((*grp)->wait_queue[1]));
-		dlinkedlist_free(&((*grp)->listeners[0]));
-		dlinkedlist_free(&((*grp)->listeners[1]));
-	
 		free(*grp);
 		*grp = NULL;
 	}
 	return 0;
 }
 
+/**
+ Returns -1: the current lwt is not the receiver of c
+ Returns -2: c is already in a group for this direction
+ Returns -3: another lwt already listens to this direction of grp
+ */
 int lwt_cgrp_add(lwt_cgrp_t grp, lwt_chan_t c, lwt_chan_dir_t dir)
 {
-	// add to wait for rcv event to happen
-	if (dir == LWT_CHAN_RCV)
-	{
-		if (c->grp[1])
-			return -2;
-		
-		c->grp[1] = grp;
-		c->events_num[1] = 0;
-		if (!dlinkedlist_find(grp->listeners[1], __lwt_current_inline()))
-			dlinkedlist_add(grp->listeners[1], dlinkedlist_element_init(__lwt_current_inline()));
-	}
-	// add to wait for snd event to happen
-	else if (dir == LWT_CHAN_SND)
-	{
-		if (c->receiver != __lwt_current_inline())
-			return -1;
+	lwt_t lwt = __lwt_current_inline();
+	// 1: wait for rcv event to happen, 0: wait for snd event to happen
+	int i = (dir == LWT_CHAN_RCV);
+	if (!i && c->receiver != lwt)
+		return -1;
 
-		if (c->grp[0])
-			return -2;
-		
-		c->grp[0] = grp;
-		c->events_num[0] = 0;
-		if (!dlinkedlist_find(grp->listeners[0], __lwt_current_inline()))
-			dlinkedlist_add(grp->listeners[0], dlinkedlist_element_init(__lwt_current_inline()));
+	__lwt_chan_lock(c);
+	__lwt_spin_lock(&grp->lock);
+	int rc = 0;
+	if (c->grp[i])
+		rc = -2;
+	else if (grp->listener[i] && grp->listener[i] != lwt)
+		rc = -3;
+	else
+	{
+		c->grp[i] = grp;
+		c->events_num[i] = 0;
+		c->event_queued[i] = 0;
+		grp->listener[i] = lwt;
+		grp->channel_num[i]++;
 	}
-	
-	grp->channel_num++;
-	return 0;
+	__lwt_spin_unlock(&grp->lock);
+	__lwt_chan_unlock(c);
+	return rc;
 }
 
 int lwt_cgrp_rem(lwt_cgrp_t grp, lwt_chan_t c)
 {
-	if (c->events_num[0] > 0 || c->events_num[1] > 0)
-		return 1;
-	
-	if (c->grp[0] == grp)
-	{
-		c->events_num[0] = 0;
-		c->event_queued[0] = 0;
-		c->grp[0] = NULL;
-		dlinkedlist_element_t* e = dlinkedlist_find(grp->listeners[0], __lwt_current_inline());
-		if (e)
-		{
-			dlinkedlist_remove(grp->listeners[0], e);
-			dlinkedlist_element_free(&e);
-		}
-	}
-	else if (c->grp[1] == grp)
+	int i, rc = -1;
+
+	__lwt_chan_lock(c);
+	__lwt_spin_lock(&grp->lock);
+	// c may be in grp in both directions
+	for (i = 0; i < 2; i++)
 	{
-		c->events_num[1] = 0;
-		c->event_queued[1] = 0;
-		c->grp[1] = NULL;
-		dlinkedlist_element_t* e = dlinkedlist_find(grp->listeners[1], __lwt_current_inline());
-		if (e)
+		if (c->grp[i] != grp)
+			continue;
+
+		// a channel still in the ready list stays until it is waited for
+		if (c->event_queued[i])
 		{
-			dlinkedlist_remove(grp->listeners[1], e);
-			dlinkedlist_element_free(&e);
+			rc = 1;
+			continue;
 		}
+		c->events_num[i] = 0;
+		c->grp[i] = NULL;
+		if (--grp->channel_num[i] == 0)
+			grp->listener[i] = NULL;
+		if (rc < 0)
+			rc = 0;
 	}
-	
-	grp->channel_num--;
-	return 0;
+	__lwt_spin_unlock(&grp->lock);
+	__lwt_chan_unlock(c);
+	return rc;
 }
 
-lwt_chan_t lwt_cgrp_wait(lwt_cgrp_t grp, lwt_chan_dir_t* dir)
+/**
+ Blocks until a channel of grp is ready, or until deadline, and returns
+ it, in the order the channels became ready. Only the listener of a
+ direction may wait on it. A channel is reported once per edge: it is
+ ready again only after the next event on it following this return.
+ Returns NULL if the deadline passed first
+ */
+static lwt_chan_t __lwt_cgrp_wait(lwt_cgrp_t grp, lwt_chan_dir_t* dir, lwt_time_t deadline)
 {
-	dlinkedlist_t* event_queue = NULL;
-	dlinkedlist_t* wq = NULL;
-	lwt_chan_dir_t evt_dir;
-	
 	lwt_t lwt = __lwt_current_inline();
-	// 1. check whether lwt is a listener for snd event
-	dlinkedlist_element_t* e = dlinkedlist_find(grp->listeners[0], lwt);
-	if (e)
+	int i;
+	// a snd event makes the channel receivable, a rcv event sendable
+	if (grp->listener[0] == lwt)
 	{
 		debug_print("%p: is waiting for snd event\n", lwt);
-		// set channel to receivable
-		evt_dir = LWT_CHAN_RCV;
-		event_queue = grp->event_queue[0];
-		wq = grp->wait_queue[0];
+		i = 0;
 	}
-	else
+	else if (grp->listener[1] == lwt)
 	{
-		e = dlinkedlist_find(grp->listeners[1], lwt);
-		if (e)
-		{
-			debug_print("%p: is waiting for rcv event\n", lwt);
-			evt_dir = LWT_CHAN_SND;
-			event_queue = grp->event_queue[1];
-			wq = grp->wait_queue[1];
-		}
+		debug_print("%p: is waiting for rcv event\n", lwt);
+		i = 1;
 	}
-	
-	if (!event_queue || !wq)
+	else
 		return NULL;
 	
-	while (dlinkedlist_size(event_queue) == 0)
+	__lwt_spin_lock(&grp->lock);
+	int timed_out = 0;
+	while (!grp->ready_head[i])
 	{
-		dlinkedlist_add(wq, dlinkedlist_element_init(lwt));
-		__lwt_block();
-	}
-	
-	dlinkedlist_element_t* evt = dlinkedlist_first(event_queue);
-	dlinkedlist_remove(event_queue, evt);
-	lwt_chan_t c = evt->data;
-	dlinkedlist_element_free(&evt);
+		if (timed_out || deadline == LWT_DEADLINE_NOW)
+		{
+			if (grp->waiter[i] == lwt)
+				grp->waiter[i] = NULL;
+			__lwt_spin_unlock(&grp->lock);
+			return NULL;
+		}
 
-	// the channel is sendable
-	if (evt_dir == LWT_CHAN_SND)
-	{
-		c->events_num[1]--;
-		c->event_queued[1]--;
-	}
-	// the channel is receivable
-	else if (evt_dir == LWT_CHAN_RCV)
-	{
-		c->events_num[0]--;
-		c->event_queued[0]--;
+		grp->waiter[i] = lwt;
+		__lwt_spin_unlock(&grp->lock);
+		timed_out = __lwt_block_until(deadline);
+		__lwt_spin_lock(&grp->lock);
 	}
+	
+	lwt_chan_t c = grp->ready_head[i];
+	if (!(grp->ready_head[i] = c->ready_next[i]))
+		grp->ready_tail[i] = NULL;
+	c->ready_next[i] = NULL;
+	c->events_num[i]--;
+	c->event_queued[i] = 0;
+	__lwt_spin_unlock(&grp->lock);
 
-	*dir = evt_dir;
+	*dir = i ? LWT_CHAN_SND : LWT_CHAN_RCV;
 	return c;
 }
 
+lwt_chan_t lwt_cgrp_wait(lwt_cgrp_t grp, lwt_chan_dir_t* dir)
+{
+	return __lwt_cgrp_wait(grp, dir, LWT_DEADLINE_NEVER);
+}
+
+lwt_chan_t lwt_cgrp_wait_timed(lwt_cgrp_t grp, lwt_chan_dir_t* dir, lwt_time_t timeout)
+{
+	return __lwt_cgrp_wait(grp, dir, __lwt_deadline(timeout));
+}
+
 
 void* __lwt_idle_thread_for_main(void* data, lwt_chan_t c)
 {
@@ -1618,13 +4034,23 @@ void* __lwt_idle_thread_for_main(void* data, lwt_chan_t c)
 __attribute__((constructor))
 static void __lwt_init()
 {
+	__lwt_page_size = sysconf(_SC_PAGESIZE);
+
 	__current_kthd = malloc(sizeof(struct __lwt_kthd_t__));
+	if (!__current_kthd || 0 != __lwt_kthd_init(__current_kthd))
+	{
+		fprintf(stderr, "lwt: cannot set up the main kernel thread\n");
+		abort();
+	}
 	__current_kthd->pthread_id = pthread_self();
-	__current_kthd->message_queue = dlinkedlist_init();
 
 	__lwt_main_thread_init();
 
-	__idle_thread = lwt_create(&__lwt_idle_thread_for_main, NULL, LWT_F_NOJOIN, NULL);
+	lwt_attr_t attr;
+	lwt_attr_init(&attr);
+	attr.flags = LWT_F_NOJOIN;
+	attr.name = "idle";
+	__idle_thread = lwt_create_attr(&__lwt_idle_thread_for_main, NULL, &attr);
 
 	debug_print("main: %p, idle: %p\n", __main_thread, __idle_thread);
 }
\ No newline at end of file
@@ -9,6 +9,9 @@
 #ifndef lwt_h
 #define lwt_h
 
+#include <sys/types.h>
+#include <sys/socket.h>
+
 /**
  LWT_NULL: Defines the marco of a NULL thread descriptor
  */
@@ -27,10 +30,10 @@ typedef enum __lwt_status_t__
 	LWT_S_CREATED = 0,		// Thread is just created. Stack is empty
 	LWT_S_READY,			// Thread is switched out, and ready to be switched to
 	LWT_S_RUNNING,			// Thread is running
-	LWT_S_BLOCKED,			// Thread is blocked and in wait queue
+	LWT_S_BLOCKED,			// Thread is blocked, known only to what it waits for
 	LWT_S_FINISHED,			// Thread is finished and is ready to be joined
 	LWT_S_ZOMBIE,			// Thread is finished and no one has joined it
-	LWT_S_DEAD				// Thread is joined and finally dead.
+	LWT_S_DEAD				// Thread is joined and finally dead, until a new thread reuses its TCB
 }lwt_status_t;
 
 typedef enum __lwt_flags_t__
@@ -46,7 +49,10 @@ typedef enum __lwt_info_type_t__
 {
 	LWT_INFO_NTHD_RUNNABLE = 0,
 	LWT_INFO_NTHD_ZOMBIES,
-	LWT_INFO_NTHD_BLOCKED
+	LWT_INFO_NTHD_BLOCKED,
+	LWT_INFO_NBYTES_SLAB,		// Bytes of stack slabs mapped by the current kernel thread
+	LWT_INFO_NBYTES_FREE,		// Bytes of them in free slots
+	LWT_INFO_NPARKS			// Times the current kernel thread slept while idle
 } lwt_info_type_t;
 
 typedef enum __lwt_chan_dir_t
@@ -57,15 +63,62 @@ typedef enum __lwt_chan_dir_t
 
 typedef struct __lwt_cgrp_t__* lwt_cgrp_t;
 
+/**
+ lwt_kthd_t: Kernel thread (pthread) that lwts are scheduled on
+ */
+typedef struct __lwt_kthd_t__ lwt_kthd_t;
+
 typedef struct __lwt_chan_t__* lwt_chan_t;
 
+/**
+ lwt_time_t: Time in nanoseconds, used for timeouts and deadlines
+ */
+typedef unsigned long long lwt_time_t;
+
 /**
  lwt_fn_t: Type of a pointer to a thread entry function
  */
 typedef void*(*lwt_fn_t)(void*, lwt_chan_t);
 
+/**
+ LWT_NAME_LEN: Maximum length of a thread name, including the '\0'
+ */
+#define LWT_NAME_LEN (16)
+
+/**
+ lwt_attr_t: Creation attributes of a thread.
+ Must be initialized by lwt_attr_init() before fields are set.
+ */
+typedef struct __lwt_attr_t__
+{
+	size_t stack_size;		// Stack size in bytes, 0 for the default size
+	lwt_flags_t flags;		// Thread flags
+	lwt_chan_t chan;		// Initial channel passed to the entry function
+	const char* name;		// Thread name (copied), NULL for none
+	lwt_kthd_t* kthd;		// Kernel thread to run on, NULL for the current one
+} lwt_attr_t;
+
 int lwt_kthd_create(lwt_fn_t fn, void* data, lwt_chan_t c);
 
+/**
+ Turns the calling kernel thread and n - 1 new ones into a pool of n workers.
+ Threads created on a worker without attr.kthd are not bound to it until
+ they first run: idle workers steal them from busy ones.
+ Returns 0 if succeeded; -1 if a pool exists or a worker cannot be started,
+ in which case no worker is left behind and the caller is not in a pool
+ */
+int lwt_kthd_pool(size_t n);
+
+/**
+ Gets the kernel thread the caller is running on
+ */
+lwt_kthd_t* lwt_kthd_current();
+
+/**
+ Initializes attr with default values
+ */
+void lwt_attr_init(lwt_attr_t* attr);
+
 /**
  Creates a lwt thread, with the entry function pointer fn,
  and the parameter pointer data used by fn
@@ -73,6 +126,13 @@ int lwt_kthd_create(lwt_fn_t fn, void* data, lwt_chan_t c);
  */
 lwt_t lwt_create(lwt_fn_t fn, void* data, lwt_flags_t flags, lwt_chan_t c);
 
+/**
+ Creates a lwt thread with the attributes in attr (NULL for defaults).
+ Stack sizes are rounded up to a size class; the largest class is 16 MB.
+ Returns LWT_NULL if the thread cannot be created
+ */
+lwt_t lwt_create_attr(lwt_fn_t fn, void* data, const lwt_attr_t* attr);
+
 lwt_status_t lwt_status(lwt_t lwt);
 
 /**
@@ -80,6 +140,56 @@ lwt_status_t lwt_status(lwt_t lwt);
  */
 void lwt_yield(lwt_t target);
 
+/**
+ Gets the time of a monotonic clock, in ns
+ */
+lwt_time_t lwt_now();
+
+/**
+ Blocks the current thread for ns nanoseconds, or until lwt_now()
+ reaches deadline, letting the other threads run meanwhile
+ */
+void lwt_sleep(lwt_time_t ns);
+void lwt_sleep_until(lwt_time_t deadline);
+
+/**
+ read(), write(), accept() and connect() that block the current thread,
+ not the kernel thread, until the fd is ready: the fd is made non-blocking
+ and polled by the netpoller of the current kernel thread, so a fd must
+ only be used from threads of one kernel thread.
+ Return values and errno as the system calls; lwt_accept returns
+ non-blocking fds
+ */
+ssize_t lwt_read(int fd, void* buf, size_t count);
+ssize_t lwt_write(int fd, const void* buf, size_t count);
+int lwt_accept(int fd, struct sockaddr* addr, socklen_t* addrlen);
+int lwt_connect(int fd, const struct sockaddr* addr, socklen_t addrlen);
+/**
+ Closes a fd used with the functions above, waking up the threads
+ blocked on it. Such a fd is to be closed this way, from its kernel
+ thread: after a plain close(), the netpoller only notices a reused
+ number once an I/O on it would block
+ */
+int lwt_close(int fd);
+
+/**
+ pread(), pwrite() and fsync() that block the current thread, not the
+ kernel thread: the operations of the kernel thread are submitted to
+ its io_uring in batches, or run by helper threads if io_uring is not
+ available. Return values and errno as the system calls
+ */
+ssize_t lwt_pread(int fd, void* buf, size_t count, off_t offset);
+ssize_t lwt_pwrite(int fd, const void* buf, size_t count, off_t offset);
+int lwt_fsync(int fd);
+
+/**
+ Runs fn(arg) on a helper pthread, blocking the current thread (and
+ not its kernel thread) until it returns, for calls into code that
+ blocks. Helpers are started as needed, up to a fixed number; fn runs
+ in place if none can be started. Returns what fn returned
+ */
+void* lwt_offload(void* (*fn)(void*), void* arg);
+
 /**
  Kill the current thread.
  Return value is passed by data
@@ -97,6 +207,12 @@ lwt_t lwt_current();
  */
 int lwt_id(lwt_t lwt);
 
+/**
+ Gets the name of a specified thread, "" if it has none.
+ Returns NULL if the thread not exists
+ */
+const char* lwt_name(lwt_t lwt);
+
 /**
  Joins a specified thread and waits for its termination.
  The pointer to the returned value will be passed via retval_ptr
@@ -109,6 +225,13 @@ int lwt_join(lwt_t lwt, void** retval_ptr);
  */
 size_t lwt_info(lwt_info_type_t type);
 
+/**
+ Sets the high-water mark of free TCB+stack memory a kernel thread keeps.
+ Above it, slabs that become entirely free are returned to the OS
+ */
+void lwt_slab_hwm_set(size_t bytes);
+size_t lwt_slab_hwm_get();
+
 void lwt_show_queue();
 
 // ===================================================================
@@ -116,6 +239,12 @@ void lwt_show_queue();
 // ===================================================================
 
 lwt_chan_t lwt_chan(size_t sz, const char* name);
+/**
+ A channel of elem_size byte values, copied into the buffer (or straight
+ into the receiver) instead of being passed by pointer.
+ Returns NULL if elem_size is 0
+ */
+lwt_chan_t lwt_chan_typed(size_t sz, size_t elem_size, const char* name);
 
 /**
  Returns -1: channel c is NULL
@@ -127,17 +256,66 @@ int lwt_chan_deref(lwt_chan_t* c);
 const char* lwt_chan_get_name(lwt_chan_t c);
 
 /**
- Returns -1: no existing receiver
- Returns -2: cannot sending to itself
+ Sends data, blocking until it is received or buffered.
+ Returns -1: cannot sending to itself, or c is a typed channel
+ Returns 0: sent
  */
 int lwt_snd(lwt_chan_t c, void* data);
 int lwt_snd_chan(lwt_chan_t c, lwt_chan_t sc);
 int lwt_snd_cdeleg(lwt_chan_t c, lwt_chan_t delegating);
 
+/**
+ Receives data, blocking until there is some.
+ c must not be a typed channel (see lwt_rcv_val): that asserts, and
+ returns NULL if asserts are disabled
+ */
 void* lwt_rcv(lwt_chan_t c);
 lwt_chan_t lwt_rcv_chan(lwt_chan_t c);
 lwt_chan_t lwt_rcv_cdeleg(lwt_chan_t c);
 
+/**
+ Batched lwt_snd, sends all n items in order.
+ Returns -1: cannot sending to itself, or c is a typed channel
+ */
+int lwt_snd_many(lwt_chan_t c, void** items, size_t n);
+/**
+ Batched lwt_rcv, blocks until at least one item is received.
+ Returns the number of items stored in out, at most max;
+ 0 if max is 0 or c is a typed channel
+ */
+size_t lwt_rcv_many(lwt_chan_t c, void** out, size_t max);
+
+/**
+ Sends the value at val, elem_size bytes of a typed channel.
+ Returns -1: cannot sending to itself
+ */
+int lwt_snd_val(lwt_chan_t c, const void* val);
+/**
+ Receives a value into val, which must hold elem_size bytes
+ */
+void lwt_rcv_val(lwt_chan_t c, void* val);
+
+/**
+ Non-blocking lwt_snd.
+ Returns -1: cannot sending to itself, or c is a typed channel
+ Returns 1: the send would block
+ Returns 0: sent
+ */
+int lwt_try_snd(lwt_chan_t c, void* data);
+/**
+ Non-blocking lwt_rcv, the received data is stored in *data.
+ Returns -1: c is a typed channel
+ Returns 1: the receive would block
+ Returns 0: received
+ */
+int lwt_try_rcv(lwt_chan_t c, void** data);
+/**
+ lwt_snd and lwt_rcv blocking for timeout ns at most.
+ Return values as lwt_try_snd and lwt_try_rcv respectively, 1 when timed out
+ */
+int lwt_snd_timed(lwt_chan_t c, void* data, lwt_time_t timeout);
+int lwt_rcv_timed(lwt_chan_t c, void** data, lwt_time_t timeout);
+
 size_t lwt_chan_sending_count(lwt_chan_t c);
 
 void* lwt_chan_mark_get(lwt_chan_t c);
@@ -145,8 +323,27 @@ void lwt_chan_mark_set(lwt_chan_t c, void* tag);
 
 lwt_cgrp_t lwt_cgrp();
 int lwt_cgrp_free(lwt_cgrp_t* grp);
+/**
+ Adds c to grp, to wait for the events of direction dir on it.
+ Returns -1: dir is LWT_CHAN_SND and the caller is not the receiver of c
+ Returns -2: c is already in a group for dir
+ Returns -3: another thread listens to grp for dir
+ Returns 0: added
+ */
 int lwt_cgrp_add(lwt_cgrp_t grp, lwt_chan_t c, lwt_chan_dir_t dir);
+/**
+ Removes c from grp, in both directions if it was added for both.
+ Returns -1: c is not in grp
+ Returns 1: an event of c is still to be waited for, c stays in grp
+ for that direction
+ Returns 0: removed
+ */
 int lwt_cgrp_rem(lwt_cgrp_t grp, lwt_chan_t c);
 lwt_chan_t lwt_cgrp_wait(lwt_cgrp_t grp, lwt_chan_dir_t* dir);
+/**
+ lwt_cgrp_wait blocking for timeout ns at most.
+ Returns NULL if no channel became ready in time
+ */
+lwt_chan_t lwt_cgrp_wait_timed(lwt_cgrp_t grp, lwt_chan_dir_t* dir, lwt_time_t timeout);
 
 #endif
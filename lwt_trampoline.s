@@ -5,12 +5,116 @@
 //  Created by cooniur on 10/17/13.
 //  Copyright (c) 2013 cooniur. All rights reserved.
 //
+//  This file is run through the C preprocessor (see AFLAGS in Makefile),
+//  so that the right code is picked for the target architecture.
+//
 
 .text
+
+#if defined(__x86_64__)
+
+// void __lwt_ctx_switch(void** save_sp, void* next_sp)
+//
+// Saves the callee-saved registers of the System V AMD64 ABI (rbx, rbp,
+// r12-r15), MXCSR and the x87 control word on the current stack, stores
+// the resulting stack pointer into *save_sp, then loads next_sp and
+// restores the same set of registers from the target's stack.
+// Caller-saved registers are already spilled by the compiler at the call.
+//
+// Frame layout at *save_sp (low -> high):
+//   0x00: mxcsr, 0x04: x87 cw, 0x08: r15, 0x10: r14, 0x18: r13,
+//   0x20: r12, 0x28: rbx, 0x30: rbp, 0x38: return address
+.align 16
+.globl __lwt_ctx_switch
+.type __lwt_ctx_switch, @function
+__lwt_ctx_switch:
+	pushq	%rbp
+	pushq	%rbx
+	pushq	%r12
+	pushq	%r13
+	pushq	%r14
+	pushq	%r15
+	subq	$8, %rsp
+	stmxcsr	(%rsp)
+	fnstcw	4(%rsp)
+
+	movq	%rsp, (%rdi)			// *save_sp = %rsp
+	movq	%rsi, %rsp				// %rsp = next_sp
+
+	ldmxcsr	(%rsp)
+	fldcw	4(%rsp)
+	addq	$8, %rsp
+	popq	%r15
+	popq	%r14
+	popq	%r13
+	popq	%r12
+	popq	%rbx
+	popq	%rbp
+	ret
+.size __lwt_ctx_switch, .-__lwt_ctx_switch
+
+// First "return" target of a new thread, built by __lwt_create_init_stack:
+//   %r12 = fn, %r13 = data, %r14 = c
+// %rsp is 16-byte aligned here, as required before a call.
 .align 16
 .globl __lwt_trampoline
+.type __lwt_trampoline, @function
+__lwt_trampoline:
+	movq	%r12, %rdi
+	movq	%r13, %rsi
+	movq	%r14, %rdx
+	call	__lwt_start
+	movq	%rax, %rdi				// return value of fn
+	call	lwt_die
+	ud2								// lwt_die never returns
+.size __lwt_trampoline, .-__lwt_trampoline
 
+#elif defined(__i386__)
+
+// void __lwt_ctx_switch(void** save_sp, void* next_sp)
+//
+// Saves the callee-saved registers of the i386 System V ABI (ebx, esi,
+// edi, ebp) on the current stack, stores %esp into *save_sp, then loads
+// next_sp and restores the same set of registers from the target's stack.
+//
+// Frame layout at *save_sp (low -> high):
+//   0x00: edi, 0x04: esi, 0x08: ebx, 0x0c: ebp, 0x10: return address
+.align 16
+.globl __lwt_ctx_switch
+.type __lwt_ctx_switch, @function
+__lwt_ctx_switch:
+	movl	4(%esp), %eax			// %eax = save_sp
+	movl	8(%esp), %edx			// %edx = next_sp
+	pushl	%ebp
+	pushl	%ebx
+	pushl	%esi
+	pushl	%edi
+
+	movl	%esp, (%eax)			// *save_sp = %esp
+	movl	%edx, %esp				// %esp = next_sp
+
+	popl	%edi
+	popl	%esi
+	popl	%ebx
+	popl	%ebp
+	ret
+.size __lwt_ctx_switch, .-__lwt_ctx_switch
+
+// First "return" target of a new thread, built by __lwt_create_init_stack:
+//   (%esp) = fn, 4(%esp) = data, 8(%esp) = c
+// %esp is 16-byte aligned here, as required before a call.
+.align 16
+.globl __lwt_trampoline
+.type __lwt_trampoline, @function
 __lwt_trampoline:
-	
-	jmp __lwt_start
+	call	__lwt_start
+	movl	%eax, (%esp)			// return value of fn becomes lwt_die's argument
+	call	lwt_die
+	ud2								// lwt_die never returns
+.size __lwt_trampoline, .-__lwt_trampoline
+
+#else
+#error "lwt: unsupported architecture"
+#endif
 
+.section .note.GNU-stack,"",@progbits
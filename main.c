@@ -9,11 +9,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "lwt.h"
 #include "debug_print.h"
 
+#if defined(__x86_64__)
+#define rdtscll(val) do { \
+		unsigned int __lo, __hi; \
+		__asm__ __volatile__("rdtsc" : "=a" (__lo), "=d" (__hi)); \
+		(val) = ((unsigned long long)__hi << 32) | __lo; \
+	} while (0)
+#else
 #define rdtscll(val) __asm__ __volatile__("rdtsc" : "=A" (val))
+#endif
 
 #define ITER 10000
 #define USE_KTHD (1)
@@ -154,6 +170,16 @@ fn_join(void *d, lwt_chan_t c)
 	return NULL;
 }
 
+int
+yield_deep(int n)
+{
+	if (!n) {
+		lwt_yield(LWT_NULL);
+		return 0;
+	}
+	return yield_deep(n - 1) + 1;
+}
+
 void
 test_crt_join_sched(void)
 {
@@ -206,9 +232,112 @@ test_crt_join_sched(void)
 	assert(lwt_info(LWT_INFO_NTHD_ZOMBIES) == 1);
 	lwt_join(chld1, NULL);
 	IS_RESET();
+
+	/* functional tests: yield to self, saved at another stack depth */
+	volatile int canary = 0x37337;
+	assert(yield_deep(20) == 20);
+	chld1 = lwt_create(fn_null, NULL, 0, NULL);
+	lwt_yield(lwt_current());
+	assert(canary == 0x37337);
+	lwt_join(chld1, NULL);
+	lwt_yield(lwt_current());
+	assert(canary == 0x37337);
+	IS_RESET();
 	printf("[TEST] thread creation/join/scheduling passed.\n");
 }
 
+void *
+fn_deep_stack(void *d, lwt_chan_t c)
+{
+	volatile char buf[128 * 1024];
+	size_t i;
+
+	for (i = 0 ; i < sizeof(buf) ; i += 1024) buf[i] = 1;
+	return buf[(size_t)d] ? d : NULL;
+}
+
+void
+test_attr(void)
+{
+	lwt_attr_t attr;
+	lwt_t chld1, chld2;
+	void *r;
+
+	printf("[TEST] creation attributes\n");
+
+	/* small stack */
+	lwt_attr_init(&attr);
+	attr.stack_size = 4 * 1024;
+	attr.name = "tiny";
+	chld1 = lwt_create_attr(fn_identity, (void*)0x37337, &attr);
+	assert(chld1);
+	assert(!strcmp(lwt_name(chld1), "tiny"));
+
+	/* large stack */
+	attr.stack_size = 256 * 1024;
+	attr.name = "a-rather-long-parser-name";
+	chld2 = lwt_create_attr(fn_deep_stack, (void*)1024, &attr);
+	assert(chld2);
+	assert(strlen(lwt_name(chld2)) == LWT_NAME_LEN - 1);
+
+	lwt_join(chld1, &r);
+	assert(r == (void*)0x37337);
+	lwt_join(chld2, &r);
+	assert(r == (void*)1024);
+	IS_RESET();
+
+	/* too large */
+	attr.stack_size = (size_t)1 << 30;
+	assert(lwt_create_attr(fn_null, NULL, &attr) == LWT_NULL);
+	assert(lwt_create_attr(fn_null, NULL, NULL) != LWT_NULL);
+	lwt_yield(LWT_NULL);
+	IS_RESET();
+	printf("[TEST] creation attributes passed.\n");
+}
+
+#define SLAB_NLWT 1000
+
+void
+test_slab(void)
+{
+	lwt_t ts[SLAB_NLWT];
+	size_t hwm, before, peak;
+	void *r;
+	int i;
+
+	printf("[TEST] slab high-water mark\n");
+
+	hwm = lwt_slab_hwm_get();
+	lwt_slab_hwm_set(0);
+	before = lwt_info(LWT_INFO_NBYTES_SLAB);
+
+	/* a burst of threads maps new slabs... */
+	for (i = 0 ; i < SLAB_NLWT ; i++) {
+		ts[i] = lwt_create(fn_identity, (void*)(long)i, 0, NULL);
+		assert(ts[i]);
+	}
+	peak = lwt_info(LWT_INFO_NBYTES_SLAB);
+	assert(peak > before);
+
+	/* ...which go back to the OS once they are all free again */
+	for (i = 0 ; i < SLAB_NLWT ; i++) {
+		assert(lwt_join(ts[i], &r) == 0);
+		assert(r == (void*)(long)i);
+	}
+	assert(lwt_info(LWT_INFO_NBYTES_SLAB) < peak / 2);
+	assert(lwt_info(LWT_INFO_NBYTES_FREE) <= lwt_info(LWT_INFO_NBYTES_SLAB));
+
+	/* joined handles still read as dead after their slabs are gone */
+	for (i = 0 ; i < SLAB_NLWT ; i++) {
+		assert(lwt_status(ts[i]) == LWT_S_DEAD);
+		assert(lwt_join(ts[i], &r) == -3);
+	}
+
+	lwt_slab_hwm_set(hwm);
+	IS_RESET();
+	printf("[TEST] slab high-water mark passed.\n");
+}
+
 void *
 fn_chan(void *data, lwt_chan_t c)
 {
@@ -370,6 +499,132 @@ test_perf_async_steam(int chsz)
 	       (end-start)/(ITER*2), chsz);
 }
 
+#define MANY_BATCH 16
+
+void *
+fn_snd_many(void *data, lwt_chan_t c)
+{
+	lwt_chan_t to = data;
+	void *items[MANY_BATCH];
+	int i, j, n;
+
+	for (i = 0 ; i < ITER ; i += n) {
+		/* odd batch sizes, so that batches straddle the ring's end */
+		n = 1 + (i % MANY_BATCH);
+		if (n > ITER - i) n = ITER - i;
+		for (j = 0 ; j < n ; j++) items[j] = (void*)(long)(i+j+1);
+		assert(lwt_snd_many(to, items, n) == 0);
+	}
+
+	lwt_chan_deref(&to);
+	return NULL;
+}
+
+void
+test_perf_snd_many(int chsz)
+{
+	lwt_chan_t from;
+	lwt_t t;
+	void *out[MANY_BATCH*4];
+	int i, j, n;
+	unsigned long long start, end;
+
+	printf("[PERF] test_perf_snd_many\n");
+
+	from = lwt_chan(chsz, "many");
+	assert(from);
+	t = lwt_create(fn_snd_many, from, 0, NULL);
+	rdtscll(start);
+	for (i = 0 ; i < ITER ; i += n) {
+		n = lwt_rcv_many(from, out, MANY_BATCH*4);
+		assert(n >= 1 && n <= MANY_BATCH*4);
+		for (j = 0 ; j < n ; j++) assert(i+j+1 == (long)out[j]);
+	}
+	rdtscll(end);
+	assert(i == ITER);
+	lwt_join(t, NULL);
+	lwt_chan_deref(&from);
+	printf("[PERF] %lld <- batched snd->rcv (buffer size %d)\n",
+	       (end-start)/(ITER*2), chsz);
+}
+
+struct typed_msg {
+	long seq;
+	long neg;
+};
+
+void *
+fn_snd_typed(void *data, lwt_chan_t c)
+{
+	lwt_chan_t to = data;
+	struct typed_msg m;
+	int i;
+
+	for (i = 0 ; i < ITER ; i++) {
+		m.seq = i;
+		m.neg = -i;
+		assert(lwt_snd_val(to, &m) == 0);
+	}
+
+	lwt_chan_deref(&to);
+	return NULL;
+}
+
+void
+test_typed(int chsz)
+{
+	lwt_chan_t from;
+	lwt_t t;
+	struct typed_msg m;
+	int i;
+
+	printf("[TEST] typed channel (buffer size %d)\n", chsz);
+
+	assert(lwt_chan_typed(chsz, 0, "typed") == NULL);
+	from = lwt_chan_typed(chsz, sizeof(struct typed_msg), "typed");
+	assert(from);
+	/* values are not pointers: the pointer API refuses them */
+	assert(lwt_snd(from, NULL) == -1);
+
+	t = lwt_create(fn_snd_typed, from, 0, NULL);
+	for (i = 0 ; i < ITER ; i++) {
+		lwt_rcv_val(from, &m);
+		assert(m.seq == i && m.neg == -i);
+	}
+	lwt_join(t, NULL);
+	lwt_chan_deref(&from);
+
+	printf("[TEST] typed channel passed.\n");
+}
+
+void *
+fn_snd_null(void *data, lwt_chan_t c)
+{
+	lwt_chan_t to = data;
+	int i;
+
+	for (i = 0 ; i < 8 ; i++) assert(lwt_snd(to, (void*)(long)(i % 2)) == 0);
+	lwt_chan_deref(&to);
+	return NULL;
+}
+
+void
+test_snd_null(int chsz)
+{
+	lwt_chan_t from;
+	lwt_t t;
+	int i;
+
+	printf("[TEST] NULL messages (buffer size %d)\n", chsz);
+	from = lwt_chan(chsz, "null");
+	assert(from);
+	t = lwt_create(fn_snd_null, from, 0, NULL);
+	for (i = 0 ; i < 8 ; i++) assert(lwt_rcv(from) == (void*)(long)(i % 2));
+	lwt_join(t, NULL);
+	lwt_chan_deref(&from);
+	printf("[TEST] NULL messages passed.\n");
+}
+
 void *
 fn_grpwait(void *d, lwt_chan_t ch)
 {
@@ -451,38 +706,832 @@ test_grpwait(int chsz, int grpsz)
 	return;
 }
 
-void* fn_kthd_test(void* data, lwt_chan_t c)
+#define GRP_MANY 1024
+
+void *
+fn_grpwait_many(void *d, lwt_chan_t ch)
+{
+	lwt_chan_t *cs = d;
+	int i;
+
+	/* backwards, so that readiness order differs from insertion order */
+	for (i = GRP_MANY-1 ; i >= 0 ; i--) {
+		lwt_snd(cs[i], (void*)(long)i);
+		lwt_chan_deref(&cs[i]);
+	}
+	return NULL;
+}
+
+void
+test_grpwait_many(void)
+{
+	static lwt_chan_t cs[GRP_MANY], snd[GRP_MANY];
+	lwt_cgrp_t g;
+	lwt_t t;
+	int i;
+
+	printf("[TEST] group wait (%d channels)\n", GRP_MANY);
+	g = lwt_cgrp();
+	assert(g);
+	for (i = 0 ; i < GRP_MANY ; i++) {
+		cs[i] = snd[i] = lwt_chan(1, "many");
+		assert(cs[i]);
+		assert(lwt_cgrp_add(g, cs[i], LWT_CHAN_SND) == 0);
+	}
+
+	t = lwt_create(fn_grpwait_many, snd, 0, NULL);
+	for (i = GRP_MANY-1 ; i >= 0 ; i--) {
+		lwt_chan_dir_t dir;
+		lwt_chan_t c = lwt_cgrp_wait(g, &dir);
+
+		assert(dir == LWT_CHAN_RCV);
+		assert(c == cs[i]);
+		assert((long)lwt_rcv(c) == i);
+	}
+	lwt_join(t, NULL);
+
+	for (i = 0 ; i < GRP_MANY ; i++) {
+		assert(lwt_cgrp_rem(g, cs[i]) == 0);
+		lwt_chan_deref(&cs[i]);
+	}
+	assert(!lwt_cgrp_free(&g));
+	printf("[TEST] group wait (%d channels) passed.\n", GRP_MANY);
+}
+
+#define TIMEOUT_NS (2 * 1000 * 1000)
+#define TIMED_NTHD 16
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *
+fn_timed_rcv(void *d, lwt_chan_t c)
+{
+	lwt_time_t timeout = (long)d;
+	unsigned long long start = now_ns();
+	void *data;
+
+	/* nobody ever sends: every one of us times out, in its own time */
+	assert(lwt_rcv_timed(c, &data, timeout) == 1);
+	assert(now_ns() - start >= timeout);
+	lwt_chan_deref(&c);
+	return NULL;
+}
+
+void *
+fn_timed_snd(void *d, lwt_chan_t c)
+{
+	lwt_chan_t to = d;
+
+	/* the receiver sits in lwt_join() */
+	if (lwt_try_snd(to, (void*)1) == 0)
+		assert(lwt_try_snd(to, (void*)2) == 1);
+	assert(lwt_snd_timed(to, (void*)3, TIMEOUT_NS) == 1);
+	lwt_chan_deref(&to);
+	return NULL;
+}
+
+void *
+fn_timed_late_snd(void *d, lwt_chan_t c)
+{
+	lwt_chan_t to = d;
+
+	lwt_snd(to, (void*)7);
+	lwt_chan_deref(&to);
+	return NULL;
+}
+
+void
+test_timed(int chsz)
+{
+	lwt_chan_t c, cs[TIMED_NTHD];
+	lwt_t t, ts[TIMED_NTHD];
+	lwt_cgrp_t g;
+	lwt_chan_dir_t dir;
+	unsigned long long start;
+	void *data;
+	int i;
+
+	printf("[TEST] timed channel operations (buffer size %d)\n", chsz);
+
+	c = lwt_chan(chsz, "timed");
+	assert(c);
+	assert(lwt_try_rcv(c, &data) == 1);
+	start = now_ns();
+	assert(lwt_rcv_timed(c, &data, TIMEOUT_NS) == 1);
+	assert(now_ns() - start >= TIMEOUT_NS);
+
+	t = lwt_create(fn_timed_snd, c, 0, NULL);
+	lwt_join(t, NULL);
+	if (chsz > 0) {
+		assert(lwt_try_rcv(c, &data) == 0 && data == (void*)1);
+		assert(lwt_try_rcv(c, &data) == 1);
+	}
+
+	/* a sender parked on the channel is taken without blocking */
+	t = lwt_create(fn_timed_late_snd, c, 0, NULL);
+	lwt_yield(t);
+	assert(lwt_rcv_timed(c, &data, TIMEOUT_NS) == 0 && data == (void*)7);
+	lwt_join(t, NULL);
+
+	g = lwt_cgrp();
+	assert(lwt_cgrp_add(g, c, LWT_CHAN_SND) == 0);
+	assert(lwt_cgrp_wait_timed(g, &dir, 0) == NULL);
+	assert(lwt_cgrp_wait_timed(g, &dir, TIMEOUT_NS) == NULL);
+	assert(lwt_cgrp_rem(g, c) == 0);
+	assert(lwt_cgrp_rem(g, c) == -1);
+
+	/* a channel in both directions leaves both at once */
+	assert(lwt_cgrp_add(g, c, LWT_CHAN_RCV) == 0);
+	assert(lwt_cgrp_add(g, c, LWT_CHAN_SND) == 0);
+	assert(lwt_cgrp_rem(g, c) == 0);
+	assert(lwt_cgrp_rem(g, c) == -1);
+	assert(!lwt_cgrp_free(&g));
+	lwt_chan_deref(&c);
+
+	/* timers of many threads, armed out of order */
+	for (i = 0 ; i < TIMED_NTHD ; i++) {
+		cs[i] = lwt_chan(chsz, "timed");
+		ts[i] = lwt_create(fn_timed_rcv,
+				   (void*)(long)((TIMED_NTHD - i) * TIMEOUT_NS / 8), 0, cs[i]);
+		lwt_chan_deref(&cs[i]);
+	}
+	for (i = 0 ; i < TIMED_NTHD ; i++) lwt_join(ts[i], NULL);
+
+	printf("[TEST] timed channel operations passed.\n");
+}
+
+#define BLOCKED_NTHD 10000
+
+void *
+fn_blocked_rcv(void *d, lwt_chan_t c)
+{
+	return lwt_rcv(c);
+}
+
+void
+test_blocked(void)
+{
+	static lwt_t ts[BLOCKED_NTHD];
+	unsigned long long start, end;
+	lwt_chan_t c;
+	lwt_t t;
+	void *r;
+	long i;
+
+	printf("[TEST] exits with %d threads blocked\n", BLOCKED_NTHD);
+
+	c = lwt_chan(0, "blocked");
+	for (i = 0 ; i < BLOCKED_NTHD ; i++) {
+		/* each child receives on c */
+		ts[i] = lwt_create(fn_blocked_rcv, NULL, 0, c);
+		lwt_yield(LWT_NULL);
+	}
+	assert(lwt_info(LWT_INFO_NTHD_BLOCKED) == BLOCKED_NTHD);
+
+	/* an exit leaves the blocked threads alone, and costs the same */
+	rdtscll(start);
+	for (i = 0 ; i < ITER ; i++) {
+		t = lwt_create(fn_null, NULL, 0, NULL);
+		lwt_join(t, NULL);
+	}
+	rdtscll(end);
+	printf("[PERF] %lld <- fork/join with %d threads blocked\n",
+	       (end-start)/ITER, BLOCKED_NTHD);
+	assert(lwt_info(LWT_INFO_NTHD_BLOCKED) == BLOCKED_NTHD);
+	assert(lwt_info(LWT_INFO_NTHD_RUNNABLE) == 1 + USE_KTHD);
+
+	for (i = 0 ; i < BLOCKED_NTHD ; i++) lwt_snd(c, (void*)(i + 1));
+	for (i = 0 ; i < BLOCKED_NTHD ; i++) {
+		assert(lwt_join(ts[i], &r) == 0);
+		assert(r);
+	}
+	lwt_chan_deref(&c);
+	IS_RESET();
+
+	printf("[TEST] exits with threads blocked passed.\n");
+}
+
+#define SLEEP_NTHD 1000
+#define SLEEP_NS (1000 * 1000)
+
+void *
+fn_sleep(void *d, lwt_chan_t c)
 {
-	printf("%p: running.\n", lwt_current());
-	void* p = lwt_rcv(c);
-	printf("%p: data rcved: %p\n", lwt_current(), p);
+	/* from a few ticks to a few ms, and past a level of the wheel */
+	lwt_time_t ns = (long)d % 7 == 0 ? 70 * SLEEP_NS : ((long)d % 50 + 1) * SLEEP_NS / 10;
+	lwt_time_t deadline = lwt_now() + ns;
+
+	lwt_sleep(ns);
+	assert(lwt_now() >= deadline);
 	return NULL;
 }
 
+void *
+fn_heartbeat(void *d, lwt_chan_t c)
+{
+	lwt_time_t next = lwt_now();
+	int i;
+
+	for (i = 0 ; i < 20 ; i++) {
+		next += SLEEP_NS;
+		lwt_sleep_until(next);
+		assert(lwt_now() >= next);
+	}
+	return NULL;
+}
+
+void
+test_sleep(void)
+{
+	lwt_t ts[SLEEP_NTHD], hb;
+	lwt_time_t start;
+	long i;
+
+	printf("[TEST] sleep\n");
+
+	start = lwt_now();
+	lwt_sleep(3 * SLEEP_NS);
+	assert(lwt_now() - start >= 3 * SLEEP_NS);
+	lwt_sleep_until(start);
+	lwt_sleep(0);
+
+	hb = lwt_create(fn_heartbeat, NULL, 0, NULL);
+	for (i = 0 ; i < SLEEP_NTHD ; i++) {
+		ts[i] = lwt_create(fn_sleep, (void*)i, 0, NULL);
+		assert(ts[i]);
+	}
+	for (i = 0 ; i < SLEEP_NTHD ; i++) lwt_join(ts[i], NULL);
+	lwt_join(hb, NULL);
+
+	printf("[TEST] sleep passed.\n");
+}
+
+#define KTHD_ITER 100
+
+void *
+fn_nparks(void *d, lwt_chan_t c)
+{
+	return (void*)lwt_info(LWT_INFO_NPARKS);
+}
+
+void *
+fn_kthd_test(void *data, lwt_chan_t c)
+{
+	lwt_chan_t reply = data;
+	int i;
+
+	/* tell the other side which kernel thread we are on */
+	lwt_snd(reply, lwt_kthd_current());
+	for (i = 0 ; i < KTHD_ITER ; i++) {
+		long v = (long)lwt_rcv(c);
+		lwt_snd(reply, (void*)(v + 1));
+	}
+
+	return NULL;
+}
+
+#define KTHD_PIPE_SZ 8
+
+void *
+fn_kthd_pipe(void *arg, lwt_chan_t ch)
+{
+	struct multisend_arg *a = arg;
+	long i;
+
+	/* the buffer is much smaller than ITER: both ends park */
+	for (i = 1 ; i <= ITER ; i++)
+		assert(lwt_snd(a->c, (void*)(a->snd_val + i)) == 0);
+	return NULL;
+}
+
+void
+test_kthd(void)
+{
+	lwt_chan_t c, reply, pipe;
+	lwt_kthd_t *kthd;
+	lwt_attr_t attr;
+	lwt_t t, t2;
+	void *r;
+	long last[2];
+	size_t nparks;
+	struct multisend_arg args[2];
+	int i;
+
+	printf("[TEST] kernel threads\n");
+
+	reply = lwt_chan(0, "kthd_reply");
+	c     = lwt_chan(0, "kthd_rcv");
+	assert(lwt_kthd_create(fn_kthd_test, reply, c) == 0);
+	kthd  = lwt_rcv(reply);
+	assert(kthd && kthd != lwt_kthd_current());
+
+	/* snd/rcv between kernel threads */
+	for (i = 0 ; i < KTHD_ITER ; i++) {
+		lwt_snd(c, (void*)(long)(i * 2 + 1));
+		assert((long)lwt_rcv(reply) == i * 2 + 2);
+	}
+
+	/* buffered channel fed from both kernel threads at once */
+	pipe = lwt_chan(KTHD_PIPE_SZ, "kthd_pipe");
+	args[0].c = args[1].c = pipe;
+	args[0].snd_val = 0;
+	args[1].snd_val = ITER;
+	lwt_attr_init(&attr);
+	attr.kthd = kthd;
+	t  = lwt_create_attr(fn_kthd_pipe, &args[0], &attr);
+	t2 = lwt_create(fn_kthd_pipe, &args[1], 0, NULL);
+	for (i = 0, last[0] = 0, last[1] = ITER ; i < ITER*2 ; i++) {
+		long v = (long)lwt_rcv(pipe), s = v > ITER;
+
+		/* in order per sender */
+		assert(v == last[s] + 1);
+		last[s] = v;
+	}
+	assert(lwt_join(t, NULL) == 0);
+	assert(lwt_join(t2, NULL) == 0);
+	lwt_chan_deref(&pipe);
+	IS_RESET();
+
+	/* create on another kernel thread, join before it dies */
+	lwt_attr_init(&attr);
+	attr.kthd = kthd;
+	t = lwt_create_attr(fn_identity, (void*)0x37337, &attr);
+	assert(t);
+	assert(lwt_join(t, &r) == 0);
+	assert(r == (void*)0x37337);
+	IS_RESET();
+
+	/* join after it died */
+	t = lwt_create_attr(fn_identity, (void*)0x37337, &attr);
+	assert(t);
+	while (lwt_status(t) != LWT_S_ZOMBIE) lwt_yield(LWT_NULL);
+	assert(lwt_join(t, &r) == 0);
+	assert(r == (void*)0x37337);
+	IS_RESET();
+
+	/* an idle kernel thread parks instead of spinning... */
+	t = lwt_create_attr(fn_nparks, NULL, &attr);
+	assert(lwt_join(t, &r) == 0);
+	nparks = (size_t)r;
+	usleep(100000);
+
+	/* ...and is woken up by the next remote create, once */
+	t = lwt_create_attr(fn_nparks, NULL, &attr);
+	assert(lwt_join(t, &r) == 0);
+	assert((size_t)r > nparks && (size_t)r < nparks + 10);
+	t = lwt_create_attr(fn_identity, (void*)0x37337, &attr);
+	assert(t);
+	assert(lwt_join(t, &r) == 0);
+	assert(r == (void*)0x37337);
+	IS_RESET();
+	printf("[TEST] kernel threads passed.\n");
+}
+
+#define NET_NCONN 500
+#define NET_BIG (1 << 20)
+
+void *
+fn_net_echo(void *d, lwt_chan_t c)
+{
+	int fd = (long)d;
+	char buf[256];
+	ssize_t n;
+
+	while ((n = lwt_read(fd, buf, sizeof(buf))) > 0)
+		assert(lwt_write(fd, buf, n) == n);
+	assert(n == 0);
+	assert(lwt_close(fd) == 0);
+	return NULL;
+}
+
+void *
+fn_net_big(void *d, lwt_chan_t c)
+{
+	int fd = (long)d;
+	char *buf = malloc(NET_BIG);
+	ssize_t n, off;
+
+	for (off = 0 ; off < NET_BIG ; off++) buf[off] = (char)off;
+	/* far more than the socket buffers: the writer blocks */
+	for (off = 0 ; off < NET_BIG ; off += n) {
+		n = lwt_write(fd, buf + off, NET_BIG - off);
+		assert(n > 0);
+	}
+	free(buf);
+	assert(lwt_close(fd) == 0);
+	return NULL;
+}
+
+void *
+fn_net_accept(void *d, lwt_chan_t c)
+{
+	int fd = (long)d, s;
+
+	s = lwt_accept(fd, NULL, NULL);
+	assert(s >= 0);
+	return fn_net_echo((void*)(long)s, c);
+}
+
+void *
+fn_net_kthd(void *d, lwt_chan_t c)
+{
+	int fd = (long)d;
+
+	/* long enough for the other kernel thread to park in epoll */
+	lwt_sleep(2 * 1000 * 1000);
+	assert(write(fd, "kthd", 4) == 4);
+	return NULL;
+}
+
+void *
+fn_net_kthd_snd(void *d, lwt_chan_t c)
+{
+	lwt_chan_t to = d;
+
+	/* long enough for the other kernel thread to park in epoll */
+	lwt_sleep(2 * 1000 * 1000);
+	assert(lwt_snd(to, (void*)0x37337) == 0);
+	lwt_chan_deref(&to);
+	return NULL;
+}
+
+static void
+net_echo(int fd, long v)
+{
+	long r;
+
+	assert(lwt_write(fd, &v, sizeof(v)) == sizeof(v));
+	assert(lwt_read(fd, &r, sizeof(r)) == sizeof(r));
+	assert(r == v);
+}
+
+void
+test_netpoll(void)
+{
+	static int sv[NET_NCONN][2];
+	static lwt_t ts[NET_NCONN];
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	unsigned long long start, end;
+	char *buf, kbuf[4];
+	ssize_t n, off;
+	lwt_chan_t c;
+	int i, lfd, fd;
+
+	printf("[TEST] netpoll (%d connections)\n", NET_NCONN);
+
+	/* many idle connections, each served by its own thread */
+	for (i = 0 ; i < NET_NCONN ; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) == 0);
+		ts[i] = lwt_create(fn_net_echo, (void*)(long)sv[i][1], 0, NULL);
+	}
+	rdtscll(start);
+	for (i = 0 ; i < NET_NCONN ; i++) net_echo(sv[i][0], i);
+	rdtscll(end);
+	printf("[PERF] %lld <- echo round trip\n", (end-start)/NET_NCONN);
+	for (i = NET_NCONN - 1 ; i >= 0 ; i--) net_echo(sv[i][0], -i);
+	for (i = 0 ; i < NET_NCONN ; i++) {
+		assert(lwt_close(sv[i][0]) == 0);
+		lwt_join(ts[i], NULL);
+	}
+
+	/* a transfer larger than the socket buffers */
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[0]) == 0);
+	ts[0] = lwt_create(fn_net_big, (void*)(long)sv[0][1], 0, NULL);
+	buf = malloc(NET_BIG);
+	for (off = 0 ; (n = lwt_read(sv[0][0], buf + off, NET_BIG - off)) > 0 ; off += n) ;
+	assert(n == 0 && off == NET_BIG);
+	for (off = 0 ; off < NET_BIG ; off++) assert(buf[off] == (char)off);
+	free(buf);
+	lwt_join(ts[0], NULL);
+	assert(lwt_close(sv[0][0]) == 0);
+
+	/* TCP: accept and connect */
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	assert(listen(lfd, 16) == 0);
+	assert(getsockname(lfd, (struct sockaddr*)&addr, &len) == 0);
+	ts[0] = lwt_create(fn_net_accept, (void*)(long)lfd, 0, NULL);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(lwt_connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	net_echo(fd, 0x37337);
+	assert(lwt_close(fd) == 0);
+	lwt_join(ts[0], NULL);
+	assert(lwt_close(lfd) == 0);
+
+	/* refused connections and closed fds fail */
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(lwt_connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1);
+	assert(errno == ECONNREFUSED);
+	assert(lwt_close(fd) == 0);
+	assert(lwt_read(fd, kbuf, sizeof(kbuf)) == -1 && errno == EBADF);
+
+	/* woken by fd readiness while parked in epoll, written by another kernel thread */
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[0]) == 0);
+	assert(lwt_kthd_create(fn_net_kthd, (void*)(long)sv[0][1], NULL) == 0);
+	assert(lwt_read(sv[0][0], kbuf, sizeof(kbuf)) == 4);
+	assert(memcmp(kbuf, "kthd", 4) == 0);
+	assert(lwt_close(sv[0][0]) == 0);
+	close(sv[0][1]);
+
+	/* woken through the eventfd by a channel send from another kernel
+	   thread, while parked in epoll for a reader that never gets data */
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[0]) == 0);
+	ts[0] = lwt_create(fn_net_echo, (void*)(long)sv[0][0], 0, NULL);
+	lwt_yield(ts[0]);
+	c = lwt_chan(0, "net_kthd");
+	assert(lwt_kthd_create(fn_net_kthd_snd, c, NULL) == 0);
+	assert(lwt_rcv(c) == (void*)0x37337);
+	lwt_chan_deref(&c);
+	close(sv[0][1]);
+	lwt_join(ts[0], NULL);
+
+	/* fd numbers reused after a plain close(): the new, blocking fds
+	   must not be taken for the registered ones */
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[0]) == 0);
+	assert(lwt_write(sv[0][0], "kthd", 4) == 4);
+	assert(lwt_read(sv[0][1], kbuf, sizeof(kbuf)) == 4);
+	close(sv[0][0]);
+	close(sv[0][1]);
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[1]) == 0);
+	assert(sv[1][0] == sv[0][0] && sv[1][1] == sv[0][1]);
+	ts[0] = lwt_create(fn_net_echo, (void*)(long)sv[1][1], 0, NULL);
+	lwt_yield(ts[0]);
+	net_echo(sv[1][0], 0x37337);
+	assert(lwt_close(sv[1][0]) == 0);
+	lwt_join(ts[0], NULL);
+
+	printf("[TEST] netpoll passed.\n");
+}
+
+#define FILE_NTHD 64
+#define FILE_BLK 4096
+
+void *
+fn_file_rw(void *d, lwt_chan_t c)
+{
+	/* the fd in the high bits, the block number in the low ones */
+	int fd = (long)d >> 16, blk = (long)d & 0xffff, i;
+	char buf[FILE_BLK];
+
+	memset(buf, blk, sizeof(buf));
+	assert(lwt_pwrite(fd, buf, sizeof(buf), (off_t)blk * FILE_BLK) == FILE_BLK);
+	memset(buf, 0, sizeof(buf));
+	assert(lwt_pread(fd, buf, sizeof(buf), (off_t)blk * FILE_BLK) == FILE_BLK);
+	for (i = 0 ; i < FILE_BLK ; i++) assert(buf[i] == (char)blk);
+	return NULL;
+}
+
+void *
+fn_file_tick(void *d, lwt_chan_t c)
+{
+	long *ticks = d;
+
+	while (!ticks[1]) {
+		ticks[0]++;
+		lwt_yield(LWT_NULL);
+	}
+	return NULL;
+}
+
+void
+test_fileio(void)
+{
+	char path[] = "/tmp/lwt_test_XXXXXX", buf[FILE_BLK];
+	unsigned long long start, end;
+	lwt_t ts[FILE_NTHD], tick;
+	long ticks[2] = { 0, 0 };
+	int fd, i;
+
+	printf("[TEST] file I/O (%d threads)\n", FILE_NTHD);
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+
+	/* the threads block, the kernel thread keeps running the others */
+	tick = lwt_create(fn_file_tick, ticks, 0, NULL);
+	rdtscll(start);
+	for (i = 0 ; i < FILE_NTHD ; i++)
+		ts[i] = lwt_create(fn_file_rw, (void*)((long)fd << 16 | i), 0, NULL);
+	for (i = 0 ; i < FILE_NTHD ; i++) lwt_join(ts[i], NULL);
+	rdtscll(end);
+	printf("[PERF] %lld <- pwrite+pread\n", (end-start)/FILE_NTHD);
+	ticks[1] = 1;
+	lwt_join(tick, NULL);
+	assert(ticks[0] > 0);
+
+	assert(lwt_fsync(fd) == 0);
+	assert(lwt_pread(fd, buf, sizeof(buf), (off_t)FILE_NTHD * FILE_BLK) == 0);
+	assert(lwt_pread(fd, buf, sizeof(buf), (off_t)(FILE_NTHD - 1) * FILE_BLK) == FILE_BLK);
+	assert(buf[0] == FILE_NTHD - 1);
+	close(fd);
+
+	/* errors are reported through errno */
+	assert(lwt_pread(fd, buf, sizeof(buf), 0) == -1 && errno == EBADF);
+	assert(lwt_fsync(-1) == -1 && errno == EBADF);
+
+	printf("[TEST] file I/O passed.\n");
+}
+
+#define OFFLOAD_NTHD 8
+#define OFFLOAD_US 20000
+
+static int offload_running, offload_overlap;
+
+void *
+fn_blocking_call(void *arg)
+{
+	/* stands for a library call that blocks its pthread */
+	if (__atomic_add_fetch(&offload_running, 1, __ATOMIC_SEQ_CST) > 1)
+		__atomic_store_n(&offload_overlap, 1, __ATOMIC_SEQ_CST);
+	usleep(OFFLOAD_US);
+	__atomic_sub_fetch(&offload_running, 1, __ATOMIC_SEQ_CST);
+	return (void*)((long)arg * 2);
+}
+
+void *
+fn_offload(void *d, lwt_chan_t c)
+{
+	return lwt_offload(fn_blocking_call, d);
+}
+
+void
+test_offload(void)
+{
+	lwt_t ts[OFFLOAD_NTHD], tick;
+	long ticks[2] = { 0, 0 };
+	void *r;
+	int i;
+
+	printf("[TEST] offload (%d threads)\n", OFFLOAD_NTHD);
+
+	/* the kernel thread keeps running the other threads meanwhile */
+	tick = lwt_create(fn_file_tick, ticks, 0, NULL);
+	for (i = 0 ; i < OFFLOAD_NTHD ; i++)
+		ts[i] = lwt_create(fn_offload, (void*)(long)i, 0, NULL);
+	for (i = 0 ; i < OFFLOAD_NTHD ; i++) {
+		assert(lwt_join(ts[i], &r) == 0);
+		assert(r == (void*)((long)i * 2));
+	}
+	/* the calls ran side by side, on helpers started as needed */
+	assert(offload_overlap);
+	ticks[1] = 1;
+	lwt_join(tick, NULL);
+	assert(ticks[0] > 0);
+
+	/* from the main thread as well */
+	assert(lwt_offload(fn_blocking_call, (void*)21) == (void*)42);
+
+	printf("[TEST] offload passed.\n");
+}
+
+#define RUNNEXT_NBUSY 32
+
+void *
+fn_pong(void *d, lwt_chan_t c)
+{
+	lwt_chan_t reply = d;
+	int i;
+
+	for (i = 0 ; i < ITER ; i++)
+		lwt_snd(reply, (void*)((long)lwt_rcv(c) + 1));
+	return NULL;
+}
+
+void
+test_runnext(void)
+{
+	static long ticks[RUNNEXT_NBUSY][2];
+	lwt_t busy[RUNNEXT_NBUSY], t;
+	lwt_chan_t req, rep;
+	unsigned long long start, end;
+	int i;
+
+	printf("[TEST] run-next ping-pong (%d busy threads)\n", RUNNEXT_NBUSY);
+
+	for (i = 0 ; i < RUNNEXT_NBUSY ; i++)
+		busy[i] = lwt_create(fn_file_tick, ticks[i], 0, NULL);
+	req = lwt_chan(0, "ping");
+	rep = lwt_chan(0, "pong");
+	t   = lwt_create(fn_pong, rep, 0, req);
+
+	/* the woken peer runs next, not behind the busy threads... */
+	rdtscll(start);
+	for (i = 0 ; i < ITER ; i++) {
+		lwt_snd(req, (void*)(long)i);
+		assert((long)lwt_rcv(rep) == i + 1);
+	}
+	rdtscll(end);
+	printf("[PERF] %lld <- snd+rcv round trip with %d busy threads\n",
+	       (end-start)/ITER, RUNNEXT_NBUSY);
+
+	/* ...but not so often that they starve */
+	for (i = 0 ; i < RUNNEXT_NBUSY ; i++) {
+		assert(ticks[i][0] > 0);
+		ticks[i][1] = 1;
+	}
+	for (i = 0 ; i < RUNNEXT_NBUSY ; i++) lwt_join(busy[i], NULL);
+	lwt_join(t, NULL);
+	lwt_chan_deref(&req);
+	lwt_chan_deref(&rep);
+	IS_RESET();
+
+	printf("[TEST] run-next ping-pong passed.\n");
+}
+
+#define POOL_NKTHD 4
+#define POOL_NLWT  1000
+
+void *
+fn_pool_work(void *d, lwt_chan_t c)
+{
+	volatile long sum = 0;
+	long i;
+
+	for (i = 0 ; i < (long)d ; i++) sum += i;
+	/* never switched out, so still on the worker that took us */
+	return lwt_kthd_current();
+}
+
+void
+test_pool(void)
+{
+	lwt_t ts[POOL_NLWT];
+	lwt_kthd_t *kthds[POOL_NKTHD];
+	int i, j, nkthd = 0;
+	void *r;
+
+	printf("[TEST] kernel thread pool (%d workers, %d threads)\n",
+	       POOL_NKTHD, POOL_NLWT);
+
+	assert(lwt_kthd_pool(POOL_NKTHD) == 0);
+	assert(lwt_kthd_pool(POOL_NKTHD) == -1);
+
+	for (i = 0 ; i < POOL_NLWT ; i++) {
+		ts[i] = lwt_create(fn_pool_work, (void*)50000, 0, NULL);
+		assert(ts[i]);
+	}
+	for (i = 0 ; i < POOL_NLWT ; i++) {
+		assert(lwt_join(ts[i], &r) == 0);
+		for (j = 0 ; j < nkthd && kthds[j] != r ; j++) ;
+		if (j == nkthd) {
+			assert(nkthd < POOL_NKTHD);
+			kthds[nkthd++] = r;
+		}
+	}
+	/* the other workers stole from the one that created everything */
+	assert(nkthd > 1);
+
+	/* join right away, racing with the worker that finishes the thread */
+	for (i = 0 ; i < POOL_NLWT * 10 ; i++) {
+		ts[0] = lwt_create(fn_pool_work, (void*)0, 0, NULL);
+		assert(ts[0]);
+		assert(lwt_join(ts[0], &r) == 0);
+		assert(r);
+	}
+	printf("[TEST] kernel thread pool passed (ran on %d workers).\n", nkthd);
+}
+
 int
 main(void)
 {
 	test_perf();
 	test_crt_join_sched();
+	test_attr();
+	test_slab();
 	test_perf_channels(0);
 	test_multisend(0);
 	test_perf_async_steam(ITER/10 < 100 ? ITER/10 : 100);
 	test_multisend(ITER/10 < 100 ? ITER/10 : 100);
+	test_perf_snd_many(ITER/10 < 100 ? ITER/10 : 100);
+	test_typed(0);
+	test_typed(5);
+	test_snd_null(0);
+	test_snd_null(3);
 	test_grpwait(0, 3);
 	test_grpwait(3, 3);
-
-/*	printf("%p: main\n", lwt_current());
-
-	lwt_chan_t c = lwt_chan(0, "r");
-	int rc = lwt_kthd_create(&fn_kthd_test, NULL, c);
-	printf("%p: lwt_kthd_create: %d\n", lwt_current(), rc);
-
-	scanf("%d");
-
-	rc = lwt_snd(c, (void*)0x123);
-	printf("%p: lwt_snd: %d\n", lwt_current(), rc);
-
-	scanf("%d");
-*/
+	test_grpwait_many();
+	test_timed(0);
+	test_timed(1);
+	test_blocked();
+	test_sleep();
+
+	test_kthd();
+	test_netpoll();
+	test_fileio();
+	test_offload();
+	test_runnext();
+	test_pool();
 	return 0;
 }
@@ -0,0 +1,213 @@
+//
+//  mpmc_queue.c
+//  lwt
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mpmc_queue.h"
+
+#define MPMC_CACHE_LINE (64)
+
+typedef struct __mpmc_cell_t__ mpmc_cell_t;
+
+// Cells are stride bytes apart: the element follows seq inline
+struct __mpmc_cell_t__
+{
+	// == position: free for the producer of that position
+	// == position + 1: holds the element for the consumer of that position
+	size_t seq;
+	char data[];
+};
+
+struct __mpmc_queue_t__
+{
+	// next position to push
+	size_t enqueue_pos __attribute__ ((aligned (MPMC_CACHE_LINE)));
+
+	// next position to pop
+	size_t dequeue_pos __attribute__ ((aligned (MPMC_CACHE_LINE)));
+
+	// read-only after init
+	char* cells __attribute__ ((aligned (MPMC_CACHE_LINE)));
+	size_t mask;
+	size_t stride;
+	size_t elem_size;
+
+	// at most mask + 1
+	size_t capacity;
+};
+
+static inline mpmc_cell_t* mpmc_cell(mpmc_queue_t *q, size_t pos)
+{
+	return (mpmc_cell_t*)(q->cells + (pos & q->mask) * q->stride);
+}
+
+static inline void mpmc_copy(void* dst, const void* src, size_t sz)
+{
+	// the common case of a pointer, without a call to memcpy
+	if (sz == sizeof(void*))
+		*(void**)dst = *(void* const*)src;
+	else
+		memcpy(dst, src, sz);
+}
+
+mpmc_queue_t* mpmc_queue_init(size_t capacity, size_t elem_size)
+{
+	size_t cap = 2;
+	while (cap < capacity)
+		cap <<= 1;
+
+	mpmc_queue_t *q = NULL;
+	if (posix_memalign((void**)&q, MPMC_CACHE_LINE, sizeof(mpmc_queue_t)))
+		return NULL;
+
+	q->elem_size = elem_size;
+	q->stride = sizeof(mpmc_cell_t) + ((elem_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1));
+	q->cells = malloc(cap * q->stride);
+	if (!q->cells)
+	{
+		free(q);
+		return NULL;
+	}
+
+	q->mask = cap - 1;
+	size_t i;
+	for (i = 0; i < cap; i++)
+		mpmc_cell(q, i)->seq = i;
+
+	q->capacity = capacity ? capacity : 1;
+	q->enqueue_pos = 0;
+	q->dequeue_pos = 0;
+	return q;
+}
+
+void mpmc_queue_free(mpmc_queue_t **q)
+{
+	if (q && *q)
+	{
+		free((*q)->cells);
+		free(*q);
+		*q = NULL;
+	}
+}
+
+size_t mpmc_queue_capacity(mpmc_queue_t *q)
+{
+	return q->capacity;
+}
+
+size_t mpmc_queue_size(mpmc_queue_t *q)
+{
+	size_t d = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	size_t e = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+	return e > d ? e - d : 0;
+}
+
+int mpmc_queue_push(mpmc_queue_t *q, const void* elem)
+{
+	return mpmc_queue_push_many(q, elem, 1);
+}
+
+int mpmc_queue_pop(mpmc_queue_t *q, void* elem)
+{
+	return mpmc_queue_pop_many(q, elem, 1);
+}
+
+size_t mpmc_queue_push_many(mpmc_queue_t *q, const void* items, size_t n)
+{
+	if (n == 0)
+		return 0;
+
+	size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+	size_t i, k;
+
+	while (1)
+	{
+		k = n;
+		// fewer elements than cells allowed: a free cell may still be
+		// over the limit. A stale dequeue_pos only makes this stricter
+		if (q->capacity <= q->mask)
+		{
+			intptr_t used = (intptr_t)(pos - __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED));
+			k = used >= (intptr_t)q->capacity ? 0 : (size_t)((intptr_t)q->capacity - used);
+			if (k > n)
+				k = n;
+		}
+
+		// the run of free cells from pos: only their producer, the one
+		// that moves enqueue_pos past them, can change them
+		for (i = 0; i < k; i++)
+			if (__atomic_load_n(&mpmc_cell(q, pos + i)->seq, __ATOMIC_ACQUIRE) != pos + i)
+				break;
+
+		if (i == 0)
+		{
+			// full, unless another producer moved on
+			size_t cur = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+			if (cur == pos)
+				return 0;
+			pos = cur;
+			continue;
+		}
+
+		k = i;
+		if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + k, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	const char* src = items;
+	for (i = 0; i < k; i++, src += q->elem_size)
+	{
+		mpmc_cell_t *cell = mpmc_cell(q, pos + i);
+		mpmc_copy(cell->data, src, q->elem_size);
+		// publishes the element to the consumer of its position
+		__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+
+size_t mpmc_queue_pop_many(mpmc_queue_t *q, void* out, size_t max)
+{
+	if (max == 0)
+		return 0;
+
+	size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	size_t i, k;
+
+	while (1)
+	{
+		// the run of filled cells from pos
+		for (i = 0; i < max; i++)
+			if (__atomic_load_n(&mpmc_cell(q, pos + i)->seq, __ATOMIC_ACQUIRE) != pos + i + 1)
+				break;
+
+		if (i == 0)
+		{
+			// empty, unless another consumer moved on
+			size_t cur = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+			if (cur == pos)
+				return 0;
+			pos = cur;
+			continue;
+		}
+
+		k = i;
+		if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + k, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	char* dst = out;
+	for (i = 0; i < k; i++, dst += q->elem_size)
+	{
+		mpmc_cell_t *cell = mpmc_cell(q, pos + i);
+		mpmc_copy(dst, cell->data, q->elem_size);
+		// hands the cell to the producer of the next lap
+		__atomic_store_n(&cell->seq, pos + i + q->mask + 1, __ATOMIC_RELEASE);
+	}
+	return k;
+}
@@ -0,0 +1,40 @@
+//
+//  mpmc_queue.h
+//  lwt
+//
+//  Bounded, lock-free, multi-producer/multi-consumer array queue
+//  (D. Vyukov's bounded MPMC queue). Every slot carries a sequence
+//  number telling whether it is ready to be written or read next, so
+//  producers and consumers only contend on their own end.
+//  Elements are copied in and out of the slots by value.
+//
+
+#ifndef lwt_mpmc_queue_h
+#define lwt_mpmc_queue_h
+
+typedef struct __mpmc_queue_t__ mpmc_queue_t;
+
+// Initialize a new, empty queue holding up to capacity elements of
+// elem_size bytes, in an array rounded up to a power of 2
+mpmc_queue_t*	mpmc_queue_init(size_t capacity, size_t elem_size);
+// Free a queue
+void			mpmc_queue_free(mpmc_queue_t **q);
+
+// Get the capacity of the queue
+size_t			mpmc_queue_capacity(mpmc_queue_t *q);
+// Get the number of elements, only a hint while other threads use the queue
+size_t			mpmc_queue_size(mpmc_queue_t *q);
+
+// Push a copy of the element at elem, can be called by any thread.
+// Returns 1 if succeeded; returns 0 if the queue is full
+int				mpmc_queue_push(mpmc_queue_t *q, const void* elem);
+// Pop the oldest element into elem, can be called by any thread.
+// Returns 1 if succeeded; returns 0 if the queue is empty
+int				mpmc_queue_pop(mpmc_queue_t *q, void* elem);
+
+// Push up to n elements of the array items in order, returns the number pushed
+size_t			mpmc_queue_push_many(mpmc_queue_t *q, const void* items, size_t n);
+// Pop up to max elements into the array out, returns the number popped
+size_t			mpmc_queue_pop_many(mpmc_queue_t *q, void* out, size_t max);
+
+#endif	// #ifndef lwt_mpmc_queue_h
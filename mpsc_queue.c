@@ -0,0 +1,99 @@
+//
+//  mpsc_queue.c
+//  lwt
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "mpsc_queue.h"
+
+#define MPSC_CACHE_LINE (64)
+
+struct __mpsc_queue_t__
+{
+	// producers' end, the most recently pushed node
+	mpsc_node_t *head __attribute__ ((aligned (MPSC_CACHE_LINE)));
+
+	// consumer's end, the next node to pop
+	mpsc_node_t *tail __attribute__ ((aligned (MPSC_CACHE_LINE)));
+
+	// placeholder that keeps the list non-empty
+	mpsc_node_t stub;
+};
+
+mpsc_queue_t* mpsc_queue_init()
+{
+	mpsc_queue_t *q = NULL;
+	if (posix_memalign((void**)&q, MPSC_CACHE_LINE, sizeof(mpsc_queue_t)))
+		return NULL;
+
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+	return q;
+}
+
+void mpsc_queue_free(mpsc_queue_t **q)
+{
+	if (q && *q)
+	{
+		free(*q);
+		*q = NULL;
+	}
+}
+
+int mpsc_queue_push(mpsc_queue_t *q, mpsc_node_t *n)
+{
+	n->next = NULL;
+	// serializes producers; a full barrier on x86
+	mpsc_node_t *prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	// until this store the consumer sees the queue as "being pushed"
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+	return prev == &q->stub;
+}
+
+mpsc_node_t* mpsc_queue_pop(mpsc_queue_t *q)
+{
+	mpsc_node_t *tail = q->tail;
+	mpsc_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub)
+	{
+		if (!next)
+			return NULL;
+		
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	// tail is the last node, unless a producer is half way through a push
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	// put the stub back behind tail, so that tail can be handed out
+	mpsc_queue_push(q, &q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+int mpsc_queue_empty(mpsc_queue_t *q)
+{
+	// the last node is only handed out once the stub is behind it again
+	return q->tail == &q->stub && __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == &q->stub;
+}
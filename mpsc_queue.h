@@ -0,0 +1,36 @@
+//
+//  mpsc_queue.h
+//  lwt
+//
+//  Intrusive, lock-free, multi-producer/single-consumer queue
+//  (D. Vyukov's non-blocking MPSC node-based queue).
+//  Nodes are embedded in the queued objects, so pushing never allocates.
+//
+
+#ifndef lwt_mpsc_queue_h
+#define lwt_mpsc_queue_h
+
+typedef struct __mpsc_queue_t__ mpsc_queue_t;
+
+typedef struct __mpsc_node_t__ mpsc_node_t;
+
+struct __mpsc_node_t__
+{
+	mpsc_node_t *next;
+};
+
+// Initialize a new, empty queue
+mpsc_queue_t*	mpsc_queue_init();
+// Free a queue (not the nodes still in it)
+void			mpsc_queue_free(mpsc_queue_t **q);
+
+// Push a node, can be called by any thread.
+// Returns 1 if the queue was seen empty before the push; otherwise, 0
+int				mpsc_queue_push(mpsc_queue_t *q, mpsc_node_t *n);
+// Pop the oldest node, consumer only.
+// Returns NULL if the queue is empty, or if the next node is still being pushed
+mpsc_node_t*	mpsc_queue_pop(mpsc_queue_t *q);
+// Returns 1 if the queue is empty; otherwise, 0. Consumer only
+int				mpsc_queue_empty(mpsc_queue_t *q);
+
+#endif	// #ifndef lwt_mpsc_queue_h
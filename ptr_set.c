@@ -0,0 +1,157 @@
+//
+//  ptr_set.c
+//  lwt
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "ptr_set.h"
+
+struct __ptr_set_t__
+{
+	// capacity - 1, capacity is a power of 2
+	size_t mask;
+	// number of pointers in the set
+	size_t size;
+	// number of slots that are in use or hold a tombstone
+	size_t used;
+	void** slots;
+};
+
+// marks a slot whose pointer was removed, so that probing goes on
+static char ptr_set_tombstone;
+#define PTR_SET_TOMBSTONE ((void*)&ptr_set_tombstone)
+
+static inline size_t ptr_set_hash(ptr_set_t *set, void* p)
+{
+	// Fibonacci hashing, the low bits of an aligned pointer are always 0
+	return (size_t)(((uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ULL) >> 17) & set->mask;
+}
+
+// Returns the slot holding p, or NULL if p is not in the set
+static void** ptr_set_find(ptr_set_t *set, void* p)
+{
+	size_t i = ptr_set_hash(set, p);
+	while (set->slots[i])
+	{
+		if (set->slots[i] == p)
+			return &set->slots[i];
+		i = (i + 1) & set->mask;
+	}
+	return NULL;
+}
+
+static int ptr_set_rehash(ptr_set_t *set, size_t capacity)
+{
+	void** slots = calloc(capacity, sizeof(void*));
+	if (!slots)
+		return -1;
+
+	void** old = set->slots;
+	size_t i, old_cap = set->mask + 1;
+
+	set->slots = slots;
+	set->mask = capacity - 1;
+	set->used = set->size;
+	for (i = 0; i < old_cap; i++)
+	{
+		if (old[i] && old[i] != PTR_SET_TOMBSTONE)
+		{
+			size_t j = ptr_set_hash(set, old[i]);
+			while (slots[j])
+				j = (j + 1) & set->mask;
+			slots[j] = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+ptr_set_t* ptr_set_init(size_t capacity)
+{
+	size_t cap = 8;
+	while (cap < capacity)
+		cap <<= 1;
+
+	ptr_set_t *set = malloc(sizeof(ptr_set_t));
+	if (!set)
+		return NULL;
+
+	set->slots = calloc(cap, sizeof(void*));
+	if (!set->slots)
+	{
+		free(set);
+		return NULL;
+	}
+
+	set->mask = cap - 1;
+	set->size = 0;
+	set->used = 0;
+	return set;
+}
+
+void ptr_set_free(ptr_set_t **set)
+{
+	if (set && *set)
+	{
+		free((*set)->slots);
+		free(*set);
+		*set = NULL;
+	}
+}
+
+size_t ptr_set_size(ptr_set_t *set)
+{
+	return set->size;
+}
+
+int ptr_set_add(ptr_set_t *set, void* p)
+{
+	if (!p)
+		return -1;
+
+	if (ptr_set_find(set, p))
+		return 0;
+
+	// keep the load factor, tombstones included, below 3/4
+	if ((set->used + 1) * 4 > (set->mask + 1) * 3)
+	{
+		size_t cap = set->mask + 1;
+		if ((set->size + 1) * 2 > cap)
+			cap <<= 1;
+		if (0 != ptr_set_rehash(set, cap))
+			return -1;
+	}
+
+	size_t i = ptr_set_hash(set, p);
+	while (set->slots[i] && set->slots[i] != PTR_SET_TOMBSTONE)
+		i = (i + 1) & set->mask;
+
+	if (!set->slots[i])
+		set->used++;
+	set->slots[i] = p;
+	set->size++;
+	return 1;
+}
+
+int ptr_set_remove(ptr_set_t *set, void* p)
+{
+	if (!p)
+		return 0;
+
+	void** slot = ptr_set_find(set, p);
+	if (!slot)
+		return 0;
+
+	*slot = PTR_SET_TOMBSTONE;
+	set->size--;
+	return 1;
+}
+
+int ptr_set_contains(ptr_set_t *set, void* p)
+{
+	return p && ptr_set_find(set, p) != NULL;
+}
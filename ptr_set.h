@@ -0,0 +1,30 @@
+//
+//  ptr_set.h
+//  lwt
+//
+//  Hash set of pointers (open addressing, linear probing).
+//  Not thread-safe: callers serialize access.
+//
+
+#ifndef lwt_ptr_set_h
+#define lwt_ptr_set_h
+
+typedef struct __ptr_set_t__ ptr_set_t;
+
+// Initialize a new, empty set, capacity is rounded up to a power of 2
+ptr_set_t*		ptr_set_init(size_t capacity);
+// Free a set
+void			ptr_set_free(ptr_set_t **set);
+
+// Get the number of pointers in the set
+size_t			ptr_set_size(ptr_set_t *set);
+
+// Add a pointer, returns 1 if added; returns 0 if it is already in the set;
+// returns -1 if p is NULL or the set cannot grow
+int				ptr_set_add(ptr_set_t *set, void* p);
+// Remove a pointer, returns 1 if removed; returns 0 if it is not in the set
+int				ptr_set_remove(ptr_set_t *set, void* p);
+// Returns 1 if the pointer is in the set; otherwise, 0
+int				ptr_set_contains(ptr_set_t *set, void* p);
+
+#endif	// #ifndef lwt_ptr_set_h
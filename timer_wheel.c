@@ -0,0 +1,237 @@
+//
+//  timer_wheel.c
+//  lwt
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+#define TW_BITS		(6)
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_LEVELS	(5)
+
+// index of the overflow list in slots
+#define TW_OVERFLOW	(TW_LEVELS * TW_SLOTS)
+
+#define TW_MASK(bits)	((1ULL << (bits)) - 1)
+
+// The timer wheel struct
+// A timer of level l expires in the same level l + 1 block of ticks as
+// tick, and in a later level l block (any block from tick on, for level
+// 0). So the slot of the current tick is empty on every level above 0:
+// it is cascaded down as soon as the tick enters its block.
+struct __timer_wheel_t__
+{
+	// next tick to process
+	unsigned long long tick;
+	size_t size;
+
+	// bit i of occupied[l] is set while slot i of level l is not empty
+	unsigned long long occupied[TW_LEVELS];
+	timer_wheel_node_t *slots[TW_LEVELS * TW_SLOTS + 1];
+};
+
+static void tw_link(timer_wheel_t *tw, timer_wheel_node_t *n, unsigned int slot)
+{
+	timer_wheel_node_t **head = &tw->slots[slot];
+
+	n->next = *head;
+	if (n->next)
+		n->next->pprev = &n->next;
+	*head = n;
+	n->pprev = head;
+	n->slot = slot;
+
+	if (slot < TW_OVERFLOW)
+		tw->occupied[slot / TW_SLOTS] |= 1ULL << (slot % TW_SLOTS);
+}
+
+static void tw_unlink(timer_wheel_t *tw, timer_wheel_node_t *n)
+{
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	n->pprev = NULL;
+
+	if (n->slot < TW_OVERFLOW && !tw->slots[n->slot])
+		tw->occupied[n->slot / TW_SLOTS] &= ~(1ULL << (n->slot % TW_SLOTS));
+}
+
+// Links n into the lowest level whose block of ticks holds both the
+// current tick and the expiry of n
+static void tw_place(timer_wheel_t *tw, timer_wheel_node_t *n)
+{
+	int l;
+	for (l = 0; l < TW_LEVELS; l++)
+	{
+		int bits = TW_BITS * (l + 1);
+		if ((n->expires >> bits) == (tw->tick >> bits))
+		{
+			tw_link(tw, n, l * TW_SLOTS + ((n->expires >> (TW_BITS * l)) & (TW_SLOTS - 1)));
+			return;
+		}
+	}
+	tw_link(tw, n, TW_OVERFLOW);
+}
+
+// Re-places all the timers of slot
+static void tw_cascade(timer_wheel_t *tw, unsigned int slot)
+{
+	timer_wheel_node_t *n = tw->slots[slot];
+
+	tw->slots[slot] = NULL;
+	if (slot < TW_OVERFLOW)
+		tw->occupied[slot / TW_SLOTS] &= ~(1ULL << (slot % TW_SLOTS));
+
+	while (n)
+	{
+		timer_wheel_node_t *next = n->next;
+		tw_place(tw, n);
+		n = next;
+	}
+}
+
+// Makes tick the current tick, cascading the slots whose block it starts,
+// top level first. Only called with no timer expiring before tick
+static void tw_set_tick(timer_wheel_t *tw, unsigned long long tick)
+{
+	int l;
+
+	tw->tick = tick;
+	if ((tick & TW_MASK(TW_BITS * TW_LEVELS)) == 0)
+		tw_cascade(tw, TW_OVERFLOW);
+	for (l = TW_LEVELS - 1; l > 0; l--)
+	{
+		if ((tick & TW_MASK(TW_BITS * l)) == 0)
+			tw_cascade(tw, l * TW_SLOTS + ((tick >> (TW_BITS * l)) & (TW_SLOTS - 1)));
+	}
+}
+
+// First tick from the current one on at which a slot comes up, ~0 if
+// there is none. *slot is set to that slot
+static unsigned long long tw_next_slot(timer_wheel_t *tw, unsigned int *slot)
+{
+	unsigned long long tick = tw->tick;
+	int l;
+
+	for (l = 0; l < TW_LEVELS; l++)
+	{
+		int shift = TW_BITS * l;
+		unsigned int i = (tick >> shift) & (TW_SLOTS - 1);
+		unsigned long long bits = tw->occupied[l];
+
+		// on level 0 the slot of the current tick is still to come
+		if (l > 0)
+			i++;
+		bits = i < TW_SLOTS ? bits & (~0ULL << i) : 0;
+		if (bits)
+		{
+			i = __builtin_ctzll(bits);
+			*slot = l * TW_SLOTS + i;
+			return ((tick >> (shift + TW_BITS)) << (shift + TW_BITS)) | ((unsigned long long)i << shift);
+		}
+	}
+
+	if (tw->slots[TW_OVERFLOW])
+	{
+		*slot = TW_OVERFLOW;
+		return ((tick >> (TW_BITS * TW_LEVELS)) + 1) << (TW_BITS * TW_LEVELS);
+	}
+	return ~0ULL;
+}
+
+timer_wheel_t *timer_wheel_init(unsigned long long tick)
+{
+	timer_wheel_t *tw = calloc(1, sizeof(timer_wheel_t));
+	if (tw)
+		tw->tick = tick;
+	return tw;
+}
+
+void timer_wheel_free(timer_wheel_t **tw)
+{
+	if (tw && *tw)
+	{
+		free(*tw);
+		*tw = NULL;
+	}
+}
+
+size_t timer_wheel_size(timer_wheel_t *tw)
+{
+	return tw->size;
+}
+
+void timer_wheel_add(timer_wheel_t *tw, timer_wheel_node_t *n, unsigned long long expires)
+{
+	if (n->pprev)
+		tw_unlink(tw, n);
+	else
+		tw->size++;
+
+	n->expires = expires < tw->tick ? tw->tick : expires;
+	tw_place(tw, n);
+}
+
+void timer_wheel_remove(timer_wheel_t *tw, timer_wheel_node_t *n)
+{
+	if (!n->pprev)
+		return;
+
+	tw_unlink(tw, n);
+	tw->size--;
+}
+
+int timer_wheel_pending(timer_wheel_node_t *n)
+{
+	return n->pprev != NULL;
+}
+
+unsigned long long timer_wheel_next(timer_wheel_t *tw)
+{
+	unsigned int slot;
+	if (!tw->size || tw_next_slot(tw, &slot) == ~0ULL)
+		return ~0ULL;
+
+	// the earliest slot holds the earliest timer; above level 0, its
+	// timers expire anywhere in the block of the slot
+	unsigned long long next = ~0ULL;
+	timer_wheel_node_t *n;
+	for (n = tw->slots[slot]; n; n = n->next)
+	{
+		if (n->expires < next)
+			next = n->expires;
+	}
+	return next;
+}
+
+timer_wheel_node_t *timer_wheel_advance(timer_wheel_t *tw, unsigned long long now)
+{
+	timer_wheel_node_t *expired = NULL, **tail = &expired;
+	unsigned long long tick;
+	unsigned int slot;
+
+	while (tw->size && (tick = tw_next_slot(tw, &slot)) <= now)
+	{
+		if (tick != tw->tick)
+			tw_set_tick(tw, tick);
+
+		// what expires now is in the level 0 slot of tick, cascaded or not
+		timer_wheel_node_t *n;
+		while ((n = tw->slots[tick & (TW_SLOTS - 1)]))
+		{
+			tw_unlink(tw, n);
+			tw->size--;
+			n->next = NULL;
+			*tail = n;
+			tail = &n->next;
+		}
+		tw_set_tick(tw, tick + 1);
+	}
+
+	if (now >= tw->tick)
+		tw_set_tick(tw, now + 1);
+	return expired;
+}
@@ -0,0 +1,52 @@
+//
+//  timer_wheel.h
+//  lwt
+//
+//  Intrusive hierarchical timing wheel (Varghese & Lauck, scheme 7).
+//  Time is counted in ticks. Each level has 64 slots, every slot of a
+//  level spans 64 times as many ticks as one of the level below, and
+//  timers too far out for the top level wait in an overflow list.
+//  A timer cascades down a level each time its slot comes up, so adding
+//  and removing one are O(1). Not thread-safe: callers serialize access.
+//
+
+#ifndef lwt_timer_wheel_h
+#define lwt_timer_wheel_h
+
+typedef struct __timer_wheel_t__ timer_wheel_t;
+
+typedef struct __timer_wheel_node_t__ timer_wheel_node_t;
+
+struct __timer_wheel_node_t__
+{
+	// tick the timer expires at
+	unsigned long long expires;
+	timer_wheel_node_t *next;
+	// link pointing to this node, NULL while the timer is not pending
+	timer_wheel_node_t **pprev;
+	unsigned int slot;
+};
+
+// Initialize a new, empty wheel, whose current tick is tick
+timer_wheel_t*		timer_wheel_init(unsigned long long tick);
+// Free a wheel (not the timers still in it)
+void				timer_wheel_free(timer_wheel_t **tw);
+
+// Get the number of pending timers
+size_t				timer_wheel_size(timer_wheel_t *tw);
+
+// Add a timer expiring at tick expires, or at the current tick if that
+// has passed. A timer that is already pending is moved
+void				timer_wheel_add(timer_wheel_t *tw, timer_wheel_node_t *n, unsigned long long expires);
+// Remove a pending timer; does nothing if the timer is not pending
+void				timer_wheel_remove(timer_wheel_t *tw, timer_wheel_node_t *n);
+// Returns 1 if the timer is in a wheel; otherwise, 0
+int					timer_wheel_pending(timer_wheel_node_t *n);
+
+// Get the tick the earliest pending timer expires at, ~0 if there is none
+unsigned long long	timer_wheel_next(timer_wheel_t *tw);
+// Move the current tick past now. Returns the timers that expired, in
+// order, linked by next; they are no longer pending
+timer_wheel_node_t*	timer_wheel_advance(timer_wheel_t *tw, unsigned long long now);
+
+#endif	// #ifndef lwt_timer_wheel_h
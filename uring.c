@@ -0,0 +1,193 @@
+//
+//  uring.c
+//  lwt
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+// The ring struct
+// The kernel shares the rings through mmap: it consumes the submission
+// ring from its head and fills the completion ring at its tail, while
+// we own the submission tail and the completion head. sqe_tail runs
+// ahead of the shared tail by the operations queued but not submitted.
+struct __uring_t__
+{
+	int fd;
+
+	// submission ring
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_tail;
+
+	// completion ring
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	unsigned int cq_entries;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+};
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+uring_t *uring_init(unsigned int entries)
+{
+	struct io_uring_params p;
+	uring_t *ur = calloc(1, sizeof(uring_t));
+	if (!ur)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ur->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ur->fd < 0)
+	{
+		free(ur);
+		return NULL;
+	}
+
+	// IORING_OP_READ and IORING_OP_WRITE came with fast poll (5.6, 5.7),
+	// and the kernel keeps the completions that overflow since 5.5
+	unsigned int features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+	if ((p.features & features) != features)
+	{
+		close(ur->fd);
+		free(ur);
+		return NULL;
+	}
+
+	// with IORING_FEAT_SINGLE_MMAP, both rings share one mapping
+	ur->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (ur->cq_ring_sz > ur->sq_ring_sz)
+		ur->sq_ring_sz = ur->cq_ring_sz;
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ur->sq_ring = mmap(NULL, ur->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					   ur->fd, IORING_OFF_SQ_RING);
+	ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ur->fd, IORING_OFF_SQES);
+	if (ur->sq_ring == MAP_FAILED || ur->sqes == MAP_FAILED)
+	{
+		if (ur->sq_ring != MAP_FAILED)
+			munmap(ur->sq_ring, ur->sq_ring_sz);
+		if (ur->sqes != MAP_FAILED)
+			munmap(ur->sqes, ur->sqes_sz);
+		close(ur->fd);
+		free(ur);
+		return NULL;
+	}
+	ur->cq_ring = ur->sq_ring;
+
+	char *sq = ur->sq_ring, *cq = ur->cq_ring;
+	ur->sq_head = (unsigned int*)(sq + p.sq_off.head);
+	ur->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	ur->sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+	ur->sq_entries = *(unsigned int*)(sq + p.sq_off.ring_entries);
+	ur->sq_array = (unsigned int*)(sq + p.sq_off.array);
+	ur->sqe_tail = *ur->sq_tail;
+
+	ur->cq_head = (unsigned int*)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	ur->cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+	ur->cq_entries = *(unsigned int*)(cq + p.cq_off.ring_entries);
+	ur->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	// slot i of the submission ring always holds sqe i
+	unsigned int i;
+	for (i = 0; i < ur->sq_entries; i++)
+		ur->sq_array[i] = i;
+
+	return ur;
+}
+
+void uring_free(uring_t **ur)
+{
+	if (ur && *ur)
+	{
+		munmap((*ur)->sqes, (*ur)->sqes_sz);
+		munmap((*ur)->sq_ring, (*ur)->sq_ring_sz);
+		close((*ur)->fd);
+		free(*ur);
+		*ur = NULL;
+	}
+}
+
+unsigned int uring_cq_entries(uring_t *ur)
+{
+	return ur->cq_entries;
+}
+
+int uring_register_eventfd(uring_t *ur, int fd)
+{
+	return syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_EVENTFD, &fd, 1) < 0 ? -1 : 0;
+}
+
+int uring_prep(uring_t *ur, int op, int fd, void* buf, unsigned int len,
+			   unsigned long long offset, void* data)
+{
+	unsigned int head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+	if (ur->sqe_tail - head >= ur->sq_entries)
+		return -1;
+
+	struct io_uring_sqe *sqe = &ur->sqes[ur->sqe_tail & ur->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = (unsigned long)data;
+	ur->sqe_tail++;
+	return 0;
+}
+
+unsigned int uring_queued(uring_t *ur)
+{
+	// including the ones a failed enter left in the ring
+	return ur->sqe_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int uring_submit(uring_t *ur)
+{
+	unsigned int n = uring_queued(ur);
+	if (!n)
+		return 0;
+
+	// publishes the sqes to the kernel
+	__atomic_store_n(ur->sq_tail, ur->sqe_tail, __ATOMIC_RELEASE);
+	return uring_enter(ur->fd, n, 0, 0);
+}
+
+int uring_reap(uring_t *ur, void** data, int* res)
+{
+	unsigned int head = *ur->cq_head;
+	if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+	*data = (void*)(unsigned long)cqe->user_data;
+	*res = cqe->res;
+	// hands the slot back to the kernel
+	__atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
@@ -0,0 +1,46 @@
+//
+//  uring.h
+//  lwt
+//
+//  Minimal io_uring ring, set up and driven through the raw system calls.
+//  Operations are queued in the submission ring, handed to the kernel in
+//  batches by uring_submit(), and their completions are popped from the
+//  completion ring without entering the kernel.
+//  Not thread-safe: callers serialize access.
+//
+
+#ifndef lwt_uring_h
+#define lwt_uring_h
+
+typedef struct __uring_t__ uring_t;
+
+// Initialize a new ring with room for entries queued operations.
+// Returns NULL if io_uring is not available
+uring_t*	uring_init(unsigned int entries);
+// Free a ring. Operations still in flight complete, unreported
+void		uring_free(uring_t **ur);
+
+// Get the number of completions the ring holds. Callers keep at most
+// that many operations in flight, uring_reap() does not look for the
+// completions the kernel keeps aside when the ring overflows
+unsigned int	uring_cq_entries(uring_t *ur);
+
+// Have the kernel signal the eventfd fd on every completion.
+// Returns 0 if succeeded; otherwise, -1
+int			uring_register_eventfd(uring_t *ur, int fd);
+
+// Queue an operation (IORING_OP_*) on fd, to be reported with data.
+// Returns 0 if succeeded; returns -1 if the submission ring is full
+int			uring_prep(uring_t *ur, int op, int fd, void* buf, unsigned int len,
+					   unsigned long long offset, void* data);
+// Get the number of queued operations not submitted yet
+unsigned int	uring_queued(uring_t *ur);
+// Submit the queued operations.
+// Returns the number submitted; returns -1 if io_uring_enter failed
+int			uring_submit(uring_t *ur);
+
+// Pop a completion, setting its data and result (>= 0, or -errno).
+// Returns 1 if succeeded; returns 0 if there is none
+int			uring_reap(uring_t *ur, void** data, int* res);
+
+#endif	// #ifndef lwt_uring_h
@@ -0,0 +1,179 @@
+//
+//  ws_deque.c
+//  lwt
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "ws_deque.h"
+
+#define WS_CACHE_LINE (64)
+
+typedef struct __ws_array_t__ ws_array_t;
+
+struct __ws_array_t__
+{
+	// capacity - 1, capacity is a power of 2
+	size_t mask;
+
+	// the array this one replaced. Thieves may still be reading it,
+	// so it is only freed with the deque
+	ws_array_t *retired;
+
+	void* buf[];
+};
+
+struct __ws_deque_t__
+{
+	// thieves' end
+	long top __attribute__ ((aligned (WS_CACHE_LINE)));
+
+	// owner's end, one past the most recently pushed element
+	long bottom __attribute__ ((aligned (WS_CACHE_LINE)));
+
+	ws_array_t *array;
+};
+
+static ws_array_t* ws_array_init(size_t capacity, ws_array_t *retired)
+{
+	ws_array_t *a = malloc(sizeof(ws_array_t) + capacity * sizeof(void*));
+	if (!a)
+		return NULL;
+
+	a->mask = capacity - 1;
+	a->retired = retired;
+	return a;
+}
+
+static inline void* ws_array_get(ws_array_t *a, long i)
+{
+	return __atomic_load_n(&a->buf[i & a->mask], __ATOMIC_RELAXED);
+}
+
+static inline void ws_array_set(ws_array_t *a, long i, void* data)
+{
+	__atomic_store_n(&a->buf[i & a->mask], data, __ATOMIC_RELAXED);
+}
+
+ws_deque_t* ws_deque_init(size_t capacity)
+{
+	size_t cap = 2;
+	while (cap < capacity)
+		cap <<= 1;
+
+	ws_deque_t *dq = NULL;
+	if (posix_memalign((void**)&dq, WS_CACHE_LINE, sizeof(ws_deque_t)))
+		return NULL;
+
+	dq->array = ws_array_init(cap, NULL);
+	if (!dq->array)
+	{
+		free(dq);
+		return NULL;
+	}
+
+	dq->top = 0;
+	dq->bottom = 0;
+	return dq;
+}
+
+void ws_deque_free(ws_deque_t **dq)
+{
+	if (dq && *dq)
+	{
+		ws_array_t *a = (*dq)->array;
+		while (a)
+		{
+			ws_array_t *retired = a->retired;
+			free(a);
+			a = retired;
+		}
+
+		free(*dq);
+		*dq = NULL;
+	}
+}
+
+int ws_deque_push(ws_deque_t *dq, void* data)
+{
+	if (!data)
+		return -1;
+
+	long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	ws_array_t *a = __atomic_load_n(&dq->array, __ATOMIC_RELAXED);
+
+	if ((size_t)(b - t) > a->mask)
+	{
+		// full: copy the live elements into an array twice as large
+		ws_array_t *na = ws_array_init((a->mask + 1) << 1, a);
+		if (!na)
+			return -1;
+
+		long i;
+		for (i = t; i < b; i++)
+			ws_array_set(na, i, ws_array_get(a, i));
+
+		__atomic_store_n(&dq->array, na, __ATOMIC_RELEASE);
+		a = na;
+	}
+
+	ws_array_set(a, b, data);
+	// publishes the element, and whatever it points to, to thieves
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void* ws_deque_pop(ws_deque_t *dq)
+{
+	long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+	ws_array_t *a = __atomic_load_n(&dq->array, __ATOMIC_RELAXED);
+	__atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+	// orders the claim on bottom against the read of top
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+	void* data = NULL;
+	if (t <= b)
+	{
+		data = ws_array_get(a, b);
+		if (t == b)
+		{
+			// the last element: race the thieves for it
+			if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				data = NULL;
+			__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	}
+	else
+		__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+
+	return data;
+}
+
+void* ws_deque_steal(ws_deque_t *dq)
+{
+	long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return NULL;
+
+	ws_array_t *a = __atomic_load_n(&dq->array, __ATOMIC_ACQUIRE);
+	void* data = ws_array_get(a, t);
+	if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+
+	return data;
+}
+
+size_t ws_deque_size(ws_deque_t *dq)
+{
+	long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+	long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+	return b > t ? (size_t)(b - t) : 0;
+}
@@ -0,0 +1,33 @@
+//
+//  ws_deque.h
+//  lwt
+//
+//  Lock-free work-stealing deque (Chase & Lev, "Dynamic Circular
+//  Work-Stealing Deque", with the C11 orderings of Le et al.).
+//  The owner pushes and pops at the bottom, any thread steals at the top.
+//
+
+#ifndef lwt_ws_deque_h
+#define lwt_ws_deque_h
+
+typedef struct __ws_deque_t__ ws_deque_t;
+
+// Initialize a new, empty deque, capacity is rounded up to a power of 2
+ws_deque_t*		ws_deque_init(size_t capacity);
+// Free a deque (not the elements still in it)
+void			ws_deque_free(ws_deque_t **dq);
+
+// Push data at the bottom, owner only. The deque grows when full.
+// Returns 0 if succeeded; returns -1 if data is NULL or growing failed
+int				ws_deque_push(ws_deque_t *dq, void* data);
+// Pop the most recently pushed element, owner only.
+// Returns NULL if the deque is empty
+void*			ws_deque_pop(ws_deque_t *dq);
+// Steal the oldest element, can be called by any thread.
+// Returns NULL if the deque is empty, or if another thread won the race
+void*			ws_deque_steal(ws_deque_t *dq);
+
+// Get the number of elements, only a hint for threads other than the owner
+size_t			ws_deque_size(ws_deque_t *dq);
+
+#endif	// #ifndef lwt_ws_deque_h